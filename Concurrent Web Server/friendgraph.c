@@ -0,0 +1,317 @@
+/*
+ * friendgraph.c - compact friend-graph store for friendlist
+ *
+ * User records live in fixed-size chunks that are never moved or freed,
+ * and are found through hash chains that only ever grow at the front, so
+ * looking a name up needs no lock. Each user's friends are a linear-probing
+ * set of IDs that doubles at 3/4 full; removal shifts later entries back
+ * instead of leaving tombstones.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "friendgraph.h"
+
+#define FG_BUCKETS (1 << 16)
+#define FG_CHUNK_BITS 12
+#define FG_CHUNK (1 << FG_CHUNK_BITS)
+#define FG_CHUNKS 4096			/* Room for 16M users */
+#define FG_MIN_SET 4
+
+/* A user: its name, its friends, and a slot the caller can hang data on */
+typedef struct {
+	char* name;
+	_Atomic fg_id next;		/* Next user in its bucket */
+	fg_id* set;			/* Friend IDs, FG_NONE where empty */
+	unsigned cap, count;
+	void* _Atomic value;
+} fg_user_t;
+
+struct friendgraph {
+	_Atomic fg_id buckets[FG_BUCKETS];
+	fg_user_t* _Atomic chunks[FG_CHUNKS];
+	fg_id count;
+	pthread_mutex_t lock;		/* Serializes fg_intern */
+};
+
+static unsigned hash_name(const char* name);
+static fg_user_t* user_of(friendgraph_t* g, fg_id id);
+static unsigned slot_of(fg_id id, unsigned cap);
+static int set_grow(fg_user_t* u);
+static int set_has(const fg_user_t* u, fg_id id);
+static int set_add(fg_user_t* u, fg_id id);
+static int set_remove(fg_user_t* u, fg_id id);
+
+
+/*
+ * make_friendgraph - creates an empty graph
+ */
+friendgraph_t* make_friendgraph(void) {
+	friendgraph_t* g = calloc(1, sizeof(friendgraph_t));
+	int i;
+
+	for (i = 0; i < FG_BUCKETS; ++i)
+		atomic_init(&g->buckets[i], FG_NONE);
+	pthread_mutex_init(&g->lock, NULL);
+
+	return g;
+}
+
+
+/*
+ * fg_find - returns name's ID, or FG_NONE if it was never interned
+ */
+fg_id fg_find(friendgraph_t* g, const char* name) {
+	fg_id id = atomic_load(&g->buckets[hash_name(name) % FG_BUCKETS]);
+
+	while (id != FG_NONE && strcmp(user_of(g, id)->name, name) != 0)
+		id = atomic_load(&user_of(g, id)->next);
+
+	return id;
+}
+
+
+/*
+ * fg_intern - returns name's ID, adding name as a user with no friends if
+ * it's new; returns FG_NONE only when the graph is full or out of memory
+ */
+fg_id fg_intern(friendgraph_t* g, const char* name) {
+	_Atomic fg_id* bucket = &g->buckets[hash_name(name) % FG_BUCKETS];
+	fg_user_t* chunk, * u;
+	char* copy;
+	fg_id id;
+
+	if ((id = fg_find(g, name)) != FG_NONE)
+		return id;
+
+	pthread_mutex_lock(&g->lock);
+
+	/* Someone may have added it since we looked */
+	if ((id = fg_find(g, name)) == FG_NONE && g->count < (fg_id)FG_CHUNKS * FG_CHUNK) {
+		id = g->count;
+		if ((copy = strdup(name)) == NULL) {
+			pthread_mutex_unlock(&g->lock);
+			return FG_NONE;
+		}
+		if ((id & (FG_CHUNK - 1)) == 0) {
+			if ((chunk = calloc(FG_CHUNK, sizeof(fg_user_t))) == NULL) {
+				free(copy);
+				pthread_mutex_unlock(&g->lock);
+				return FG_NONE;
+			}
+			atomic_store(&g->chunks[id >> FG_CHUNK_BITS], chunk);
+		}
+		g->count++;
+
+		u = user_of(g, id);
+		u->name = copy;
+		atomic_init(&u->value, NULL);
+		atomic_init(&u->next, atomic_load(bucket));
+
+		/* Publish last, once the record is complete */
+		atomic_store(bucket, id);
+	}
+
+	pthread_mutex_unlock(&g->lock);
+
+	return id;
+}
+
+
+/*
+ * fg_name - returns the name id was interned from
+ */
+const char* fg_name(friendgraph_t* g, fg_id id) {
+	return user_of(g, id)->name;
+}
+
+
+/*
+ * fg_value - returns id's value slot, NULL until the caller stores to it
+ */
+void* _Atomic* fg_value(friendgraph_t* g, fg_id id) {
+	return &user_of(g, id)->value;
+}
+
+
+/*
+ * fg_link - makes a and b friends; returns 1 if they weren't already, or
+ * -1, leaving both unchanged, if out of memory
+ */
+int fg_link(friendgraph_t* g, fg_id a, fg_id b) {
+	int added;
+
+	if (a == b)
+		return 0;
+	if ((added = set_add(user_of(g, a), b)) <= 0)
+		return added;
+
+	if (set_add(user_of(g, b), a) < 0) {
+		set_remove(user_of(g, a), b);
+		return -1;
+	}
+	return 1;
+}
+
+
+/*
+ * fg_unlink - ends the friendship of a and b; returns 1 if they had one
+ */
+int fg_unlink(friendgraph_t* g, fg_id a, fg_id b) {
+	if (!set_remove(user_of(g, a), b))
+		return 0;
+
+	set_remove(user_of(g, b), a);
+	return 1;
+}
+
+
+/*
+ * fg_degree - returns how many friends id has
+ */
+unsigned fg_degree(friendgraph_t* g, fg_id id) {
+	return user_of(g, id)->count;
+}
+
+
+/*
+ * fg_next_friend - walks id's friends in no particular order: start with
+ * *pos at 0, and each call stores the next one in *friend, or returns 0
+ * once there are no more
+ */
+int fg_next_friend(friendgraph_t* g, fg_id id, unsigned* pos, fg_id* friend) {
+	fg_user_t* u = user_of(g, id);
+
+	while (*pos < u->cap) {
+		if ((*friend = u->set[(*pos)++]) != FG_NONE)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * hash_name - FNV-1a hash of a user name
+ */
+static unsigned hash_name(const char* name) {
+	unsigned hash = 2166136261u;
+
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+
+	return hash;
+}
+
+
+/*
+ * user_of - returns id's record; its chunk was published before id was
+ */
+static fg_user_t* user_of(friendgraph_t* g, fg_id id) {
+	return &atomic_load(&g->chunks[id >> FG_CHUNK_BITS])[id & (FG_CHUNK - 1)];
+}
+
+
+/*
+ * slot_of - home slot of id in a set of cap (a power of 2) slots
+ */
+static unsigned slot_of(fg_id id, unsigned cap) {
+	return (id * 2654435761u) & (cap - 1);
+}
+
+
+/*
+ * set_grow - doubles u's set and rehashes its friends into it; returns -1,
+ * keeping the old set, if out of memory
+ */
+static int set_grow(fg_user_t* u) {
+	unsigned cap = u->cap ? u->cap * 2 : FG_MIN_SET, i, j;
+	fg_id* set = malloc(sizeof(fg_id) * cap);
+
+	if (set == NULL)
+		return -1;
+	memset(set, 0xFF, sizeof(fg_id) * cap);	/* All FG_NONE */
+	for (i = 0; i < u->cap; ++i) {
+		if (u->set[i] == FG_NONE)
+			continue;
+		for (j = slot_of(u->set[i], cap); set[j] != FG_NONE; j = (j + 1) & (cap - 1))
+			;
+		set[j] = u->set[i];
+	}
+
+	free(u->set);
+	u->set = set;
+	u->cap = cap;
+	return 0;
+}
+
+
+/*
+ * set_has - returns 1 if id is one of u's friends
+ */
+static int set_has(const fg_user_t* u, fg_id id) {
+	unsigned i;
+
+	if (u->cap == 0)
+		return 0;
+
+	for (i = slot_of(id, u->cap); u->set[i] != FG_NONE; i = (i + 1) & (u->cap - 1)) {
+		if (u->set[i] == id)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * set_add - adds id to u's friends; returns 0 if it was already there, or
+ * -1 if the set had to grow and couldn't
+ */
+static int set_add(fg_user_t* u, fg_id id) {
+	unsigned i;
+
+	/* Look first, so a friend already there never needs the set to grow */
+	if (set_has(u, id))
+		return 0;
+
+	/* Staying at most 3/4 full keeps probes short and always ending */
+	if ((u->count + 1) * 4 > u->cap * 3 && set_grow(u) < 0)
+		return -1;
+
+	for (i = slot_of(id, u->cap); u->set[i] != FG_NONE; i = (i + 1) & (u->cap - 1))
+		;
+
+	u->set[i] = id;
+	u->count++;
+	return 1;
+}
+
+
+/*
+ * set_remove - removes id from u's friends; returns 0 if it wasn't there
+ */
+static int set_remove(fg_user_t* u, fg_id id) {
+	unsigned mask = u->cap - 1, i, j;
+
+	if (u->count == 0)
+		return 0;
+
+	for (i = slot_of(id, u->cap); u->set[i] != id; i = (i + 1) & mask) {
+		if (u->set[i] == FG_NONE)
+			return 0;
+	}
+
+	/* Pull back any later entry whose home slot isn't between i and it */
+	for (j = (i + 1) & mask; u->set[j] != FG_NONE; j = (j + 1) & mask) {
+		if (((j - slot_of(u->set[j], u->cap)) & mask) >= ((j - i) & mask)) {
+			u->set[i] = u->set[j];
+			i = j;
+		}
+	}
+
+	u->set[i] = FG_NONE;
+	u->count--;
+	return 1;
+}
@@ -0,0 +1,32 @@
+/*
+ * friendgraph.h - compact friend-graph store for friendlist
+ *
+ * Users are interned to dense integer IDs, and each user's friends are
+ * kept as an open-addressing hash set of IDs, so an edge costs a few
+ * bytes and befriend/unfriend are O(1) amortized.
+ *
+ * Concurrency: fg_find, fg_name and fg_value may be called from any thread
+ * without locking, and fg_intern locks internally. Everything that reads or
+ * changes a user's friends must be serialized by the caller per user.
+ */
+#ifndef FRIENDGRAPH_H
+#define FRIENDGRAPH_H
+
+typedef unsigned int fg_id;
+#define FG_NONE ((fg_id)-1)
+
+typedef struct friendgraph friendgraph_t;
+
+friendgraph_t* make_friendgraph(void);
+
+fg_id fg_find(friendgraph_t* g, const char* name);
+fg_id fg_intern(friendgraph_t* g, const char* name);
+const char* fg_name(friendgraph_t* g, fg_id id);
+void* _Atomic* fg_value(friendgraph_t* g, fg_id id);
+
+int fg_link(friendgraph_t* g, fg_id a, fg_id b);
+int fg_unlink(friendgraph_t* g, fg_id a, fg_id b);
+unsigned fg_degree(friendgraph_t* g, fg_id id);
+int fg_next_friend(friendgraph_t* g, fg_id id, unsigned* pos, fg_id* friend);
+
+#endif
@@ -15,9 +15,80 @@
 #include "csapp.h"
 #include "dictionary.h"
 #include "more_string.h"
-
+#include "friendgraph.h"
+#include <sys/epoll.h>
+#include <stdatomic.h>
+
+#define DEFAULT_THREADS 16
+#define DEFAULT_QUEUE 1024
+#define MAX_EVENTS 64
+#define ACCEPT_RETRY_MS 100	/* How soon to retry accept after running out of fds */
+#define IO_TIMEOUT 5		/* Seconds a worker waits on one client read or write */
+#define INTRODUCE_THREADS 4
+#define INTRODUCE_QUEUE 64
+#define SHARDS 64
+#define RECLAIM_BATCH 32
+
+/* Bounded queue of connections whose whole request has already arrived */
+typedef struct {
+	int* fds;
+	int size, head, count;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty, not_full;
+} conn_queue_t;
+
+static void queue_init(conn_queue_t* q, int size);
+static void queue_put(conn_queue_t* q, int fd);
+static int queue_try_put(conn_queue_t* q, int fd);
+static int queue_take(conn_queue_t* q);
+
+/* A user's whole /friends response, cached; replaced whole, never modified */
+typedef struct snapshot {
+	unsigned long retired;		/* Epoch at which it was replaced */
+	struct snapshot* next;		/* Next in its shard's retired list */
+	_Atomic int refs;		/* Readers still sending it */
+	size_t header_len, body_len;
+	char response[];		/* Header, then the newline-joined friends */
+} snapshot_t;
+
+/* Writers' slice of the friend graph: the users whose ID maps here */
+typedef struct {
+	pthread_mutex_t lock;
+	snapshot_t* retired;
+	int nretired;
+} shard_t;
+
+/* A worker's read-side epoch, 0 while it isn't reading; one per cache line */
+typedef struct {
+	_Atomic unsigned long epoch;
+	char pad[64 - sizeof(unsigned long)];
+} reader_t;
+
+static snapshot_t* new_snapshot(size_t body_len, char** body);
+static void replace(shard_t* shard, fg_id user, snapshot_t* snap);
+static int publish(shard_t* shard, fg_id user);
+static int patch_add(shard_t* shard, fg_id user, fg_id friend);
+static int patch_remove(shard_t* shard, fg_id user, fg_id friend);
+static void reclaim(shard_t* shard);
+static void lock_pair(shard_t* a, shard_t* b);
+static void unlock_pair(shard_t* a, shard_t* b);
+static int publish_user(const char* name, int create);
+static int link_users(const char* user, const char* friend);
+static int unlink_users(const char* user, const char* friend);
+static int serve_friends(int fd, const char* user);
+
+/* A pool thread: the queue it serves and where it announces its reads */
+typedef struct {
+	conn_queue_t* queue;
+	reader_t* reader;
+} worker_t;
+
+static int accept_all(int epfd, int listenfd);
+static void dispatch(int epfd, int fd, unsigned events);
+static int request_ready(int fd, int* introduction);
+static void* worker(void* arg);
+static void set_timeouts(int fd);
 static void doit(int fd);
-static void* just_doit(void* connfdp);
 static dictionary_t* read_requesthdrs(rio_t* rp);
 static void read_postquery(rio_t* rp, dictionary_t* headers, dictionary_t* d);
 static void clienterror(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg);
@@ -29,25 +100,49 @@ static void unfriend(int fd, dictionary_t* query);
 static void introduce(int fd, dictionary_t* query);
 static void get_friends(int fd, dictionary_t* query);
 
-dictionary_t* friend_dict;
-pthread_mutex_t lock;
+friendgraph_t* graph;
+shard_t shards[SHARDS];
+reader_t* readers;
+int nreaders;
+_Atomic unsigned long global_epoch = 1;
+static __thread reader_t* self;
+conn_queue_t ready;
+conn_queue_t introductions;
 
 
+/*
+ * main - runs the reactor: one thread waits on an edge-triggered epoll set,
+ * accepts connections, and hands each one to a fixed pool of workers once
+ * its request has fully arrived, so no worker ever blocks on a slow client.
+ * /introduce requests go to a pool of their own: they wait on another
+ * server, often this one, whose /friends must always find a free worker.
+ */
 int main(int argc, char** argv) {
-	int listenfd, connfd;
-	char hostname[MAXLINE], port[MAXLINE];
-	socklen_t clientlen;
-	struct sockaddr_storage clientaddr;
+	int listenfd, epfd, n, i, backlog = 0;
+	int threads = DEFAULT_THREADS, queue_size = DEFAULT_QUEUE;
+	struct epoll_event event, events[MAX_EVENTS];
+	pthread_t thread;
+	worker_t* workers;
 
 	/* Check command line args */
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	if (argc > 2)
+		threads = atoi(argv[2]);
+	if (argc > 3)
+		queue_size = atoi(argv[3]);
+	if (argc < 2 || argc > 4 || threads <= 0 || queue_size <= 0) {
+		fprintf(stderr, "usage: %s <port> [threads] [queue]\n", argv[0]);
 		exit(1);
 	}
 
 	listenfd = Open_listenfd(argv[1]);
-	friend_dict = make_dictionary(COMPARE_CASE_SENS, free);
-	pthread_mutex_init(&lock, NULL);
+	graph = make_friendgraph();
+	for (i = 0; i < SHARDS; ++i)
+		pthread_mutex_init(&shards[i].lock, NULL);
+	nreaders = threads + INTRODUCE_THREADS;
+	readers = calloc(nreaders, sizeof(reader_t));
+	workers = malloc(sizeof(worker_t) * nreaders);
+	queue_init(&ready, queue_size);
+	queue_init(&introductions, INTRODUCE_QUEUE);
 
 	/* Don't kill the server if there's an error, because
 	   we want to survive errors due to a client. But we
@@ -57,35 +152,236 @@ int main(int argc, char** argv) {
 	/* Also, don't stop on broken connections: */
 	Signal(SIGPIPE, SIG_IGN);
 
+	for (i = 0; i < nreaders; ++i) {
+		workers[i].queue = i < threads ? &ready : &introductions;
+		workers[i].reader = &readers[i];
+		pthread_create(&thread, NULL, worker, &workers[i]);
+		pthread_detach(thread);
+	}
+
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	event.events = EPOLLIN | EPOLLET;
+	event.data.fd = listenfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event);
+
 	while (1) {
-		clientlen = sizeof(clientaddr);
-		connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
-		if (connfd >= 0) {
-			Getnameinfo((SA*)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-			//printf("Accepted connection from (%s, %s)\n", hostname, port);
-
-			int* connfd_p  = malloc(sizeof(int));
-			*connfd_p = connfd;
-			pthread_t thread;
-			pthread_create(&thread, NULL, just_doit, connfd_p);
-			pthread_detach(thread);
+		/* A backlog left behind won't raise another edge, so poll for it */
+		n = epoll_wait(epfd, events, MAX_EVENTS, backlog ? ACCEPT_RETRY_MS : -1);
+		for (i = 0; i < n; ++i) {
+			if (events[i].data.fd == listenfd)
+				backlog = 1;
+			else
+				dispatch(epfd, events[i].data.fd, events[i].events);
 		}
+		if (backlog)
+			backlog = accept_all(epfd, listenfd) < 0;
 	}
 }
 
 
 /*
- * just_doit - simple driver for doit function below
+ * accept_all - accepts every pending connection (the listener is
+ * edge-triggered, so one event can stand for many) and watches each for
+ * input; returns -1 if it had to stop with connections possibly still
+ * queued (out of fds, say), which the caller must come back for
  */
-void* just_doit(void* connfd_p) {
-	int connfd = *((int*)connfd_p);
-	free(connfd_p);
-	doit(connfd);
-	close(connfd);
+static int accept_all(int epfd, int listenfd) {
+	static int stalled;
+	struct epoll_event event;
+	int connfd;
+
+	while (1) {
+		if ((connfd = accept(listenfd, NULL, NULL)) >= 0) {
+			event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+			event.data.fd = connfd;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &event) < 0)
+				close(connfd);
+			continue;
+		}
+
+		/* Interrupted, or that client gave up: the rest are still queued */
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			stalled = 0;
+			return 0;
+		}
+
+		/* Report once per stall, not on every retry */
+		if (!stalled)
+			perror("accept");
+		stalled = 1;
+		return -1;
+	}
+}
+
+
+/*
+ * dispatch - queues a connection for the workers once its request is
+ * complete; otherwise leaves it in the epoll set until more data arrives
+ */
+static void dispatch(int epfd, int fd, unsigned events) {
+	int introduction = 0, state = request_ready(fd, &introduction);
+
+	if (state == 0 && !(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		return;
+
+	/* A client that hung up mid-request can never finish it; don't let it
+	   tie up a worker */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (state <= 0)
+		close(fd);
+	else if (!introduction)
+		queue_put(&ready, fd);
+	else if (!queue_try_put(&introductions, fd)) {
+		/* Waiting here could stall the /friends those introductions need */
+		clienterror(fd, "/introduce", "503", "Service Unavailable", "too many introductions in progress");
+		close(fd);
+	}
+}
+
+
+/*
+ * request_ready - peeks (without consuming) at what fd has received and
+ * returns 1 when the headers and any Content-Length body are all there,
+ * 0 if more is on the way, or -1 if the client closed without sending;
+ * sets *introduction if the request is for /introduce
+ */
+static int request_ready(int fd, int* introduction) {
+	char buf[MAXBUF + 1], * end, * line;
+	ssize_t n;
+	long len = 0;
+
+	n = recv(fd, buf, MAXBUF, MSG_PEEK | MSG_DONTWAIT);
+	if (n == 0)
+		return -1;
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+	buf[n] = 0;
+	line = strchr(buf, ' ');
+	*introduction = line != NULL && starts_with("/introduce", line + 1);
+
+	/* Too big to peek at whole; the worker's reads will just wait for the rest */
+	if (n == MAXBUF)
+		return 1;
+
+	end = strstr(buf, "\r\n\r\n");
+	if (end == NULL)
+		return 0;
+	end += 4;
+
+	for (line = strstr(buf, "\r\n"); line != NULL && line + 2 < end; line = strstr(line + 2, "\r\n")) {
+		if (!strncasecmp(line + 2, "Content-Length:", 15)) {
+			len = atol(line + 17);
+			break;
+		}
+	}
+
+	return (buf + n - end) >= len;
+}
+
+
+/*
+ * worker - serves connections from its worker_t's (arg) queue, one request
+ * each, announcing reads of friend lists in its reader_t
+ */
+static void* worker(void* arg) {
+	worker_t* w = arg;
+	int connfd;
+
+	self = w->reader;
+	while (1) {
+		connfd = queue_take(w->queue);
+		set_timeouts(connfd);
+		doit(connfd);
+		close(connfd);
+	}
+
 	return NULL;
 }
 
 
+/*
+ * set_timeouts - bounds each blocking read and write on fd by IO_TIMEOUT, so
+ * a client that stalls (say, past the peeked MAXBUF bytes, or by never
+ * reading its response) only holds a worker that long
+ */
+static void set_timeouts(int fd) {
+	struct timeval tv = { IO_TIMEOUT, 0 };
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+/*
+ * queue_init - creates an empty queue that holds at most size connections
+ */
+static void queue_init(conn_queue_t* q, int size) {
+	q->fds = malloc(sizeof(int) * size);
+	q->size = size;
+	q->head = q->count = 0;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+
+/*
+ * queue_put - adds fd to the queue, waiting while it's full; stalling the
+ * reactor leaves new clients in the kernel's listen backlog
+ */
+static void queue_put(conn_queue_t* q, int fd) {
+	pthread_mutex_lock(&q->mutex);
+	while (q->count == q->size)
+		pthread_cond_wait(&q->not_full, &q->mutex);
+	q->fds[(q->head + q->count++) % q->size] = fd;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+
+/*
+ * queue_try_put - adds fd to the queue unless it's full; returns 0 if full
+ */
+static int queue_try_put(conn_queue_t* q, int fd) {
+	int added;
+
+	pthread_mutex_lock(&q->mutex);
+	if ((added = q->count < q->size)) {
+		q->fds[(q->head + q->count++) % q->size] = fd;
+		pthread_cond_signal(&q->not_empty);
+	}
+	pthread_mutex_unlock(&q->mutex);
+
+	return added;
+}
+
+
+/*
+ * queue_take - removes the oldest connection, waiting while the queue is empty
+ */
+static int queue_take(conn_queue_t* q) {
+	int fd;
+
+	pthread_mutex_lock(&q->mutex);
+	while (q->count == 0)
+		pthread_cond_wait(&q->not_empty, &q->mutex);
+	fd = q->fds[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->mutex);
+
+	return fd;
+}
+
+
 /*
  * doit - handles one HTTP request/response transaction
  */
@@ -119,24 +415,15 @@ void doit(int fd) {
 			if (!strcasecmp(method, "POST"))
 				read_postquery(&rio, headers, query);
 
-			if (starts_with("/friends", uri)) {
-				pthread_mutex_lock(&lock);
+			/* Readers take no locks; writers lock only the shards they touch */
+			if (starts_with("/friends", uri))
 				get_friends(fd, query);
-				pthread_mutex_unlock(&lock);
-			}
-			else if (starts_with("/befriend", uri)) {
-				pthread_mutex_lock(&lock);
+			else if (starts_with("/befriend", uri))
 				befriend(fd, query);
-				pthread_mutex_unlock(&lock);
-			}
-			else if (starts_with("/unfriend", uri)) {
-				pthread_mutex_lock(&lock);
+			else if (starts_with("/unfriend", uri))
 				unfriend(fd, query);
-				pthread_mutex_unlock(&lock);
-			}
-			else if (starts_with("/introduce", uri)) {
+			else if (starts_with("/introduce", uri))
 				introduce(fd, query);
-			}
 
 			/* Clean up */
 			free_dictionary(query);
@@ -158,10 +445,8 @@ dictionary_t* read_requesthdrs(rio_t* rp) {
 	char buf[MAXLINE];
 	dictionary_t* dict = make_dictionary(COMPARE_CASE_INSENS, free);
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	//printf("%s", buf);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	/* Stop at the blank line, or at EOF/timeout if it never comes */
+	while (Rio_readlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
 		//printf("%s", buf);
 		parse_header_line(buf, dict);
 	}
@@ -186,7 +471,7 @@ void read_postquery(rio_t* rp, dictionary_t* headers, dictionary_t* dest) {
 	Rio_readnb(rp, buffer, len);
 	buffer[len] = 0;
 
-	if (!strcasecmp(type, "application/x-www-form-urlencoded")) {
+	if (type && !strcasecmp(type, "application/x-www-form-urlencoded")) {
 		parse_query(buffer, dest);
 	}
 
@@ -218,28 +503,28 @@ static char* ok_header(size_t len, const char* content_type) {
  */
 static void get_friends(int fd, dictionary_t* query) {
 	
-	if (dictionary_count(query) != 1)
+	if (dictionary_count(query) != 1) {
 		clienterror(fd, "GET", "400", "Bad Request", "<user> field is required");
+		return;
+	}
 
 	char* user = dictionary_get(query, "user");
 
-	if (user == NULL)
+	if (user == NULL) {
 		clienterror(fd, "GET", "400", "Bad Request", "<user> field was null");
-
-	dictionary_t* users_friends = dictionary_get(friend_dict, user);
-
-	char* body;
-
-	if (users_friends == NULL) {
-		body = "";
-		serve_request(fd, body);
+		return;
 	}
-	else {
-		const char** friends_arr = dictionary_keys(users_friends);
 
-		body = join_strings(friends_arr, '\n');
-		serve_request(fd, body);
-	}
+	if (serve_friends(fd, user))
+		return;
+
+	/* A known user without a snapshot lost it to a failed allocation (or is
+	   still being added): rebuild it, and only an unknown user gets "" */
+	int published = publish_user(user, 0);
+	if (published == 0)
+		serve_request(fd, "");
+	else if (published < 0 || !serve_friends(fd, user))
+		clienterror(fd, "GET", "503", "Service Unavailable", "out of memory");
 }
 
 
@@ -261,50 +546,28 @@ static void befriend(int fd, dictionary_t* query) {
 	char* user = dictionary_get(query, "user");
 
 	if (user == NULL) {
-		dictionary_t* new_user = make_dictionary(COMPARE_CASE_SENS, free);
-		dictionary_set(friend_dict, user, new_user);
+		clienterror(fd, "POST", "400", "Bad Request", "<user> field was null");
+		return;
 	}
 
-	dictionary_t* users_friends = dictionary_get(friend_dict, user);
+	char** friends_arr = split_string((char*)dictionary_get(query, "friends"), '\n');
 
-	if (users_friends == NULL) {
-		users_friends = make_dictionary(COMPARE_CASE_SENS, free);
-		dictionary_set(friend_dict, user, users_friends);
+	if (friends_arr == NULL) {
+		clienterror(fd, "POST", "400", "Bad Request", "<friends> field was null");
+		return;
 	}
-	
-	char** friends_arr = split_string((char*)dictionary_get(query, "friends"), '\n');
 
-	int idx;
+	int idx, failed = 0;
 	for (idx = 0; friends_arr[idx] != NULL; ++idx) {
-		if (strcmp(friends_arr[idx], user) == 0)
-			continue;
-
-		dictionary_t* user_dict = dictionary_get(friend_dict, user);
-
-		if (user_dict == NULL) {
-			user_dict = make_dictionary(COMPARE_CASE_SENS, free);
-			dictionary_set(friend_dict, user, user_dict);
-		}
-
-		if (dictionary_get(user_dict, friends_arr[idx]) == NULL)
-			dictionary_set(user_dict, friends_arr[idx], NULL);
-
-		dictionary_t* next_friend = dictionary_get(friend_dict, friends_arr[idx]);
-
-		if (next_friend == NULL) {
-			next_friend = make_dictionary(COMPARE_CASE_SENS, free);
-			dictionary_set(friend_dict, friends_arr[idx], next_friend);
-		}
-		
-		if (dictionary_get(next_friend, user) == NULL)
-			dictionary_set(next_friend, user, NULL);
+		if (strcmp(friends_arr[idx], user) != 0 && link_users(user, friends_arr[idx]) < 0)
+			failed = 1;
+		free(friends_arr[idx]);
 	}
-	
-	const char** users_friends_arr = dictionary_keys(users_friends);
+	free(friends_arr);
 
-	char* body = join_strings(users_friends_arr, '\n');
-
-	serve_request(fd, body);
+	/* Only a full graph or a failed allocation leaves the list unsent */
+	if (publish_user(user, 1) <= 0 || failed || !serve_friends(fd, user))
+		clienterror(fd, "POST", "503", "Service Unavailable", "friend graph is full or out of memory");
 }
 
 
@@ -330,13 +593,6 @@ static void unfriend(int fd, dictionary_t* query) {
 		return;
 	}
 
-	dictionary_t* users_friends = dictionary_get(friend_dict, user);
-
-	if (users_friends == NULL) {
-		clienterror(fd, "POST", "400", "Bad Request", "<user> field was invalid");
-		return;
-	}
-
 	char** remove_arr = split_string((char*)dictionary_get(query, "friends"), '\n');
 
 	if (remove_arr == NULL) {
@@ -344,21 +600,20 @@ static void unfriend(int fd, dictionary_t* query) {
 		return;
 	}
 	
-	int idx;
+	int idx, failed = 0;
 	for (idx = 0; remove_arr[idx] != NULL; ++idx) {	
-		dictionary_remove(users_friends, remove_arr[idx]);
-		
-		dictionary_t* removed_friend = dictionary_get(friend_dict, remove_arr[idx]);
-
-		if (removed_friend != NULL)
-			dictionary_remove(removed_friend, user);
+		if (unlink_users(user, remove_arr[idx]) < 0)
+			failed = 1;
+		free(remove_arr[idx]);
 	}
-	
-	const char** users_friends_arr = dictionary_keys(users_friends);
+	free(remove_arr);
 
-	char* body = join_strings(users_friends_arr, '\n');
-	
-	serve_request(fd, body);
+	/* Unlinking never adds users, so an unknown user is still unknown here */
+	int published = publish_user(user, 0);
+	if (published < 0 || (published > 0 && failed))
+		clienterror(fd, "POST", "503", "Service Unavailable", "out of memory");
+	else if (!serve_friends(fd, user))
+		clienterror(fd, "POST", "400", "Bad Request", "<user> field was invalid");
 }
 
 
@@ -383,16 +638,28 @@ static void introduce(int fd, dictionary_t* query) {
 	}
 	
 	int connfd = Open_clientfd(host, port);
+
+	if (connfd < 0) {
+		clienterror(fd, host, "502", "Bad Gateway", "could not connect to target server");
+		return;
+	}
+
+	/* The target may be this server, or one that never answers */
+	set_timeouts(connfd);
+
 	char buffer[MAXBUF];
-	sprintf(buffer, "GET /friends?user=%s HTTP/1.1\r\n\r\n", query_encode(friend));
+	snprintf(buffer, MAXBUF, "GET /friends?user=%s HTTP/1.1\r\n\r\n", query_encode(friend));
 	Rio_writen(connfd, buffer, strlen(buffer));
 	shutdown(connfd, SHUT_WR);
 
 	rio_t rio;
 	char buf[MAXLINE];
 	Rio_readinitb(&rio, connfd);
-	if (Rio_readlineb(&rio, buf, MAXLINE) <= 0)
+	if (Rio_readlineb(&rio, buf, MAXLINE) <= 0) {
 		clienterror(fd, "POST", "400", "Bad Request", "target server error");
+		close(connfd);
+		return;
+	}
 
 	char* status;
 	char* version;
@@ -414,61 +681,31 @@ static void introduce(int fd, dictionary_t* query) {
 			char* len_str = dictionary_get(headers, "Content-length");
 			int len = (len_str ? atoi(len_str) : 0);
 
-			char buff[len];
-
 			if (len <= 0)
 				clienterror(fd, "GET", "400", "Bad Request", "target server did not provide any friends");
 
 			else {
-				Rio_readnb(&rio, buff, len);
-				buff[len] = 0;
+				/* The target sets len, so keep its body off the stack */
+				char* buff = malloc(len + 1);
+				ssize_t got = Rio_readnb(&rio, buff, len);
 
-				pthread_mutex_lock(&lock);
-				dictionary_t* users_friends = dictionary_get(friend_dict, user);
-
-				if (users_friends == NULL) {
-					users_friends = make_dictionary(COMPARE_CASE_SENS, NULL);
-					dictionary_set(friend_dict, user, users_friends);
-				}
+				buff[got > 0 ? got : 0] = 0;
 
 				char** friends_arr = split_string(buff, '\n');
 
-				int idx;
+				int idx, failed = 0;
 				for (idx = 0; friends_arr[idx] != NULL; ++idx) {
-					if (strcmp(friends_arr[idx], user) == 0)
-						continue;
-
-					dictionary_t* user_dict = dictionary_get(friend_dict, user);
-
-					if (user_dict == NULL) {
-						user_dict = make_dictionary(COMPARE_CASE_SENS, free);
-						dictionary_set(friend_dict, user, user_dict);
-					}
-					
-					if (dictionary_get(user_dict, friends_arr[idx]) == NULL)
-						dictionary_set(user_dict, friends_arr[idx], NULL);
-
-					dictionary_t* next_friend = dictionary_get(friend_dict, friends_arr[idx]);
-
-					if (next_friend == NULL) {
-						next_friend = make_dictionary(COMPARE_CASE_SENS, free);
-						dictionary_set(friend_dict, friends_arr[idx], next_friend);
-					}
-					
-					if (dictionary_get(next_friend, user) == NULL)
-						dictionary_set(next_friend, user, NULL);
-
+					if (strcmp(friends_arr[idx], user) != 0 && link_users(user, friends_arr[idx]) < 0)
+						failed = 1;
 					free(friends_arr[idx]);
 				}
 				free(friends_arr);
+				free(buff);
 
-				const char** users_friends_arr = dictionary_keys(users_friends);
-				pthread_mutex_unlock(&lock);
-
-				char* body = join_strings(users_friends_arr, '\n');
-				serve_request(fd, body);
-				free(body);
+				if (publish_user(user, 1) <= 0 || failed || !serve_friends(fd, user))
+					clienterror(fd, "POST", "503", "Service Unavailable", "friend graph is full or out of memory");
 			}
+			free_dictionary(headers);
 		}
 	}
 	free(version);
@@ -478,6 +715,315 @@ static void introduce(int fd, dictionary_t* query) {
 }
 
 
+/*
+ * new_snapshot - allocates a snapshot with its 200 OK header filled in
+ * for a body_len-byte body, and points *body at where the body goes;
+ * returns NULL if out of memory
+ */
+static snapshot_t* new_snapshot(size_t body_len, char** body) {
+	char* header = ok_header(body_len, "text/html; charset=utf-8");
+	size_t header_len;
+	snapshot_t* snap;
+
+	if (header == NULL)
+		return NULL;
+
+	header_len = strlen(header);
+	if ((snap = malloc(sizeof(snapshot_t) + header_len + body_len + 1)) == NULL) {
+		free(header);
+		return NULL;
+	}
+
+	atomic_init(&snap->refs, 0);
+	snap->header_len = header_len;
+	snap->body_len = body_len;
+	memcpy(snap->response, header, header_len);
+	free(header);
+
+	*body = snap->response + header_len;
+	(*body)[body_len] = 0;
+
+	return snap;
+}
+
+
+/*
+ * replace - publishes snap as user's snapshot and retires the old one;
+ * the caller holds shard's lock. A NULL snap just retires the old one,
+ * so the next writer or reader rebuilds it from the graph
+ */
+static void replace(shard_t* shard, fg_id user, snapshot_t* snap) {
+	snapshot_t* old = atomic_exchange(fg_value(graph, user), snap);
+
+	if (old == NULL)
+		return;
+
+	/* Readers that see the bumped epoch can only have loaded the new snap */
+	old->retired = atomic_fetch_add(&global_epoch, 1);
+	old->next = shard->retired;
+	shard->retired = old;
+	if (++shard->nretired >= RECLAIM_BATCH)
+		reclaim(shard);
+}
+
+
+/*
+ * publish - rebuilds user's snapshot from the graph; the caller holds
+ * shard's lock. Returns -1 if out of memory, leaving user with no snapshot
+ * rather than a stale one
+ */
+static int publish(shard_t* shard, fg_id user) {
+	unsigned pos = 0, i;
+	size_t len = 0, n;
+	snapshot_t* snap;
+	fg_id friend;
+	char* body, * p;
+
+	while (fg_next_friend(graph, user, &pos, &friend))
+		len += strlen(fg_name(graph, friend)) + 1;
+	len -= (len > 0);
+
+	if ((snap = new_snapshot(len, &body)) == NULL) {
+		replace(shard, user, NULL);
+		return -1;
+	}
+	for (pos = 0, i = 0, p = body; fg_next_friend(graph, user, &pos, &friend); p += n, ++i) {
+		if (i > 0)
+			*p++ = '\n';
+		n = strlen(fg_name(graph, friend));
+		memcpy(p, fg_name(graph, friend), n);
+	}
+
+	replace(shard, user, snap);
+	return 0;
+}
+
+
+/*
+ * patch_add - publishes user's cached list with friend appended, without
+ * walking the graph; the caller holds shard's lock. Returns -1 like publish
+ */
+static int patch_add(shard_t* shard, fg_id user, fg_id friend) {
+	snapshot_t* old = atomic_load(fg_value(graph, user)), * snap;
+	const char* name = fg_name(graph, friend);
+	size_t n = strlen(name), len;
+	char* body;
+
+	if (old == NULL)
+		return publish(shard, user);
+
+	len = old->body_len + (old->body_len > 0) + n;
+	if ((snap = new_snapshot(len, &body)) == NULL) {
+		replace(shard, user, NULL);
+		return -1;
+	}
+	memcpy(body, old->response + old->header_len, old->body_len);
+	if (old->body_len > 0)
+		body[old->body_len] = '\n';
+	memcpy(body + len - n, name, n);
+
+	replace(shard, user, snap);
+	return 0;
+}
+
+
+/*
+ * patch_remove - publishes user's cached list with friend's line cut out,
+ * without walking the graph; the caller holds shard's lock. Returns -1 like
+ * publish
+ */
+static int patch_remove(shard_t* shard, fg_id user, fg_id friend) {
+	snapshot_t* old = atomic_load(fg_value(graph, user)), * snap;
+	const char* name = fg_name(graph, friend);
+	size_t n = strlen(name), len, at, cut;
+	char* old_body, * line = NULL, * next, * body;
+
+	if (old != NULL) {
+		old_body = old->response + old->header_len;
+		for (line = old_body; ; line = next + 1) {
+			if (!strncmp(line, name, n) && (line[n] == '\n' || line[n] == 0))
+				break;
+			if ((next = strchr(line, '\n')) == NULL) {
+				line = NULL;
+				break;
+			}
+		}
+	}
+	if (line == NULL)
+		return publish(shard, user);
+
+	/* Cut the line plus one separator: the one after it, or before the last */
+	at = line - old_body;
+	cut = n + (old->body_len > n);
+	if (at + n == old->body_len && at > 0)
+		at--;
+
+	len = old->body_len - cut;
+	if ((snap = new_snapshot(len, &body)) == NULL) {
+		replace(shard, user, NULL);
+		return -1;
+	}
+	memcpy(body, old_body, at);
+	memcpy(body + at, old_body + at + cut, len - at);
+
+	replace(shard, user, snap);
+	return 0;
+}
+
+
+/*
+ * reclaim - frees shard's retired snapshots that no reader can still hold:
+ * those retired before the oldest epoch a worker is reading in, and that
+ * no worker is still sending
+ */
+static void reclaim(shard_t* shard) {
+	unsigned long oldest = atomic_load(&global_epoch), epoch;
+	snapshot_t** link = &shard->retired, * snap;
+	int i;
+
+	for (i = 0; i < nreaders; ++i) {
+		epoch = atomic_load(&readers[i].epoch);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+
+	while ((snap = *link) != NULL) {
+		if (snap->retired < oldest && atomic_load(&snap->refs) == 0) {
+			*link = snap->next;
+			free(snap);
+			shard->nretired--;
+		}
+		else
+			link = &snap->next;
+	}
+}
+
+
+/*
+ * lock_pair - locks two shards, lower address first so that two
+ * writers locking the same pair can't deadlock
+ */
+static void lock_pair(shard_t* a, shard_t* b) {
+	if (a > b) {
+		shard_t* t = a;
+		a = b;
+		b = t;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	if (b != a)
+		pthread_mutex_lock(&b->lock);
+}
+
+
+/*
+ * unlock_pair - releases shards locked by lock_pair
+ */
+static void unlock_pair(shard_t* a, shard_t* b) {
+	if (b != a)
+		pthread_mutex_unlock(&b->lock);
+	pthread_mutex_unlock(&a->lock);
+}
+
+
+/*
+ * publish_user - republishes name's friend list after link_users or
+ * unlink_users changed it, adding the user first if create is set. Returns
+ * 1 if published, 0 if there's no such user (or no room to add one), or -1
+ * if out of memory
+ */
+static int publish_user(const char* name, int create) {
+	fg_id user = create ? fg_intern(graph, name) : fg_find(graph, name);
+	shard_t* shard = &shards[user % SHARDS];
+	int rc;
+
+	if (user == FG_NONE)
+		return 0;
+
+	pthread_mutex_lock(&shard->lock);
+	rc = publish(shard, user);
+	pthread_mutex_unlock(&shard->lock);
+
+	return rc < 0 ? -1 : 1;
+}
+
+
+/*
+ * link_users - records that user and friend are friends, both ways; only
+ * friend's list is republished, the caller republishes user's once it's done.
+ * Returns -1 if the graph is full or out of memory, else 0
+ */
+static int link_users(const char* user, const char* friend) {
+	fg_id u = fg_intern(graph, user), f = fg_intern(graph, friend);
+	shard_t* a = &shards[u % SHARDS];
+	shard_t* b = &shards[f % SHARDS];
+	int linked;
+
+	if (u == FG_NONE || f == FG_NONE)
+		return -1;
+
+	lock_pair(a, b);
+	if ((linked = fg_link(graph, u, f)) > 0 || (linked == 0 && atomic_load(fg_value(graph, f)) == NULL)) {
+		if (patch_add(b, f, u) < 0)
+			linked = -1;
+	}
+	unlock_pair(a, b);
+
+	return linked < 0 ? -1 : 0;
+}
+
+
+/*
+ * unlink_users - removes the friendship between user and friend, both ways;
+ * like link_users, leaves republishing user's list to the caller. Returns -1
+ * if friend's list couldn't be republished, else 0
+ */
+static int unlink_users(const char* user, const char* friend) {
+	fg_id u = fg_find(graph, user), f = fg_find(graph, friend);
+	shard_t* a = &shards[u % SHARDS];
+	shard_t* b = &shards[f % SHARDS];
+	int rc = 0;
+
+	if (u == FG_NONE || f == FG_NONE)
+		return 0;
+
+	lock_pair(a, b);
+	if (fg_unlink(graph, u, f))
+		rc = patch_remove(b, f, u);
+	unlock_pair(a, b);
+
+	return rc;
+}
+
+
+/*
+ * serve_friends - sends user's cached response, header and all, in one
+ * write and without locking; returns 0 (sending nothing) if user is unknown
+ */
+static int serve_friends(int fd, const char* user) {
+	fg_id u;
+	snapshot_t* snap = NULL;
+
+	/* Announce the epoch before loading, so reclaim won't free what we load */
+	atomic_store(&self->epoch, atomic_load(&global_epoch));
+
+	/* A user being added has an ID but no snapshot yet; it's still unknown */
+	if ((u = fg_find(graph, user)) != FG_NONE && (snap = atomic_load(fg_value(graph, u))) != NULL)
+		atomic_fetch_add(&snap->refs, 1);
+
+	/* Leave the epoch before the write: a client that won't read must only
+	   pin this one snapshot, not hold back reclaim everywhere */
+	atomic_store(&self->epoch, 0);
+
+	if (snap != NULL) {
+		Rio_writen(fd, snap->response, snap->header_len + snap->body_len);
+		atomic_fetch_sub(&snap->refs, 1);
+	}
+
+	return snap != NULL;
+}
+
+
 /*
  * serve_request - sends server response to client
  */
@@ -0,0 +1,189 @@
+/*
+ * autotune.c - Times every dispatchable complex/motion variant on this
+ * machine over a grid of dims, thread counts and block sizes, and writes
+ * the winner for each dim to a profile that kernels.c loads at startup.
+ *
+ * Build: gcc -O2 -o autotune autotune.c kernels.c -lpthread
+ * Usage: autotune [-o profile] [-d dim,dim,...] [-t max_threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "kernels.h"
+
+#define MAX_DIMS 32
+#define MIN_TIME 0.05  // Seconds of repeated runs per measurement.
+
+void naive_complex(int, pixel*, pixel*);
+void naive_motion(int, pixel*, pixel*);
+
+/* kernels.c registers with the lab driver; there is none here. */
+void add_complex_function(complex_test_func f, char* descr) { (void)f; (void)descr; }
+void add_motion_function(motion_test_func f, char* descr) { (void)f; (void)descr; }
+
+static int default_dims[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+static int complex_blocks[] = { 16, 32, 64, 128, 256 };
+static int motion_bands[] = { 8, 16, 32, 64, 128 };
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * time_variant - Best time of one call, repeating until MIN_TIME has passed.
+ */
+static double time_variant(const kernel_variant* v, int dim, pixel* src, pixel* dst, int threads, int block)
+{
+    double best = 1e30, start = now();
+    int runs = 0;
+
+    v->fn(dim, src, dst, threads, block);  // Warm up caches and the thread pool.
+    while (runs < 3 || now() - start < MIN_TIME)
+    {
+        double t = now();
+        v->fn(dim, src, dst, threads, block);
+        t = now() - t;
+        if (t < best)
+            best = t;
+        runs++;
+    }
+    return best;
+}
+
+/*
+ * tune - Finds the fastest variant and knobs of one kernel at one dim and
+ * appends it to the profile.
+ */
+static void tune(FILE* out, int kernel, int dim, int max_threads, pixel* src, pixel* dst, pixel* ref)
+{
+    const char* kname = (kernel == KERNEL_COMPLEX) ? "complex" : "motion";
+    const int* blocks = (kernel == KERNEL_COMPLEX) ? complex_blocks : motion_bands;
+    int nblocks = (kernel == KERNEL_COMPLEX) ? sizeof(complex_blocks) / sizeof(int) : sizeof(motion_bands) / sizeof(int);
+    const kernel_variant* list;
+    const kernel_variant* best = NULL;
+    int n = kernel_variants(kernel, &list);
+    int best_threads = 1, best_block = 0, k, b, t;
+    double best_time = 1e30;
+
+    if (kernel == KERNEL_COMPLEX)
+        naive_complex(dim, src, ref);
+    else
+        naive_motion(dim, src, ref);
+
+    for (k = 0; k < n; k++)
+    {
+        list[k].fn(dim, src, dst, 1, blocks[0]);  // Check it before timing it.
+        if (memcmp(dst, ref, sizeof(pixel) * dim * dim))
+        {
+            fprintf(stderr, "%s: %s gives wrong output at dim %d, skipped\n", kname, list[k].name, dim);
+            continue;
+        }
+
+        /* Thread counts 1, 2, 4, ... and max_threads itself. */
+        for (t = 1; t <= (list[k].tunable ? max_threads : 1); t = (t < max_threads && 2 * t > max_threads) ? max_threads : 2 * t)
+            for (b = 0; b < (list[k].tunable ? nblocks : 1); b++)
+            {
+                int block = list[k].tunable ? blocks[b] : 0;
+                double secs = time_variant(&list[k], dim, src, dst, t, block);
+
+                if (secs < best_time)
+                {
+                    best = &list[k];
+                    best_time = secs;
+                    best_threads = t;
+                    best_block = block;
+                }
+            }
+    }
+
+    if (best)
+    {
+        fprintf(out, "%s %d %s %d %d\n", kname, dim, best->name, best_threads, best_block);
+        printf("%-8s %5d  %-18s threads %2d  block %3d  %8.1f us  %.2f ns/pixel\n", kname, dim, best->name,
+               best_threads, best_block, best_time * 1e6, best_time * 1e9 / ((double)dim * dim));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = "kernels.profile";
+    int dims[MAX_DIMS], ndims = 0, max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN), opt, d, k;
+    FILE* out;
+
+    while ((opt = getopt(argc, argv, "o:d:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            path = optarg;
+            break;
+        case 'd':
+            for (char* p = optarg; *p && ndims < MAX_DIMS; )
+            {
+                dims[ndims++] = (int)strtol(p, &p, 10);
+                while (*p == ',')
+                    p++;
+            }
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-o profile] [-d dim,dim,...] [-t max_threads]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (ndims == 0)
+        for (ndims = 0; ndims < (int)(sizeof(default_dims) / sizeof(int)); ndims++)
+            dims[ndims] = default_dims[ndims];
+    if (max_threads < 1)
+        max_threads = 1;
+
+    if ((out = fopen(path, "w")) == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fprintf(out, "# kernel dim variant threads block -- written by autotune, %d threads max\n", max_threads);
+
+    for (d = 0; d < ndims; d++)
+    {
+        int dim = dims[d];
+        size_t n = (size_t)dim * dim;
+        pixel* src = malloc(sizeof(pixel) * n);
+        pixel* dst = malloc(sizeof(pixel) * n);
+        pixel* ref = malloc(sizeof(pixel) * n);
+
+        if (dim < 3 || !src || !dst || !ref)
+        {
+            fprintf(stderr, "skipping dim %d\n", dim);
+            free(src);
+            free(dst);
+            free(ref);
+            continue;
+        }
+        for (k = 0; k < (int)n; k++)
+        {
+            src[k].red = (unsigned short)rand();
+            src[k].green = (unsigned short)rand();
+            src[k].blue = (unsigned short)rand();
+        }
+
+        tune(out, KERNEL_COMPLEX, dim, max_threads, src, dst, ref);
+        tune(out, KERNEL_MOTION, dim, max_threads, src, dst, ref);
+
+        free(src);
+        free(dst);
+        free(ref);
+    }
+
+    fclose(out);
+    printf("profile written to %s\n", path);
+    return 0;
+}
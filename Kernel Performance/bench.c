@@ -0,0 +1,474 @@
+/*
+ * bench.c - Standalone benchmark for the Performance Lab kernels.
+ *
+ * Registers kernels.c's variants the same way the lab driver does, checks
+ * each one against naive_complex/naive_motion, and reports cycles per
+ * element, GB/s, and LLC, L1D and dTLB misses (from perf_event_open) as
+ * CSV or JSON, so runs can be diffed over time. The "(rgbx32)" rows run
+ * complex8/motion8 on the 8-bit part of the same input and must match the
+ * 16-bit result exactly.
+ *
+ * Build: gcc -O2 -o bench bench.c perfctr.c kernels.c -lpthread
+ * Usage: bench [-f csv|json] [-d dim,dim,...] [-o file] [-r]
+ *
+ * -r only runs recip_check(), the exhaustive test of the reciprocal divides
+ * against real division, and exits non-zero on any mismatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "kernels.h"
+#include "perfctr.h"
+
+#define MAX_FUNCS 64
+#define MAX_DIMS  32
+#define MIN_TIME  0.1   // Seconds of repeated runs per measurement.
+
+/* Buffers for the "(huge pages)" rows, compared with the malloc'd ones. */
+#define IMAGE_HUGE_FLAGS (IMAGE_HUGETLB | IMAGE_THP | IMAGE_FIRST_TOUCH)
+
+void naive_complex(int, pixel*, pixel*);
+void naive_motion(int, pixel*, pixel*);
+
+/* What the lab driver would collect from register_*_functions. */
+static complex_test_func complex_funcs[MAX_FUNCS];
+static char* complex_descrs[MAX_FUNCS];
+static int num_complex;
+static motion_test_func motion_funcs[MAX_FUNCS];
+static char* motion_descrs[MAX_FUNCS];
+static int num_motion;
+
+void add_complex_function(complex_test_func f, char* descr)
+{
+    if (num_complex < MAX_FUNCS)
+    {
+        complex_funcs[num_complex] = f;
+        complex_descrs[num_complex++] = descr;
+    }
+}
+
+void add_motion_function(motion_test_func f, char* descr)
+{
+    if (num_motion < MAX_FUNCS)
+    {
+        motion_funcs[num_motion] = f;
+        motion_descrs[num_motion++] = descr;
+    }
+}
+
+static int default_dims[] = { 64, 96, 128, 200, 256, 384, 512, 1000, 1024, 2048, 3000, 4096, 8192 };
+
+/* One timed configuration: a kernel call plus whatever it needs. */
+typedef struct {
+    const char* kernel;
+    const char* name;
+    void (*run)(void* ctx);
+    void* ctx;
+    int pixel_bytes;            // Bytes per pixel moved; 0 means sizeof(pixel)
+} bench_case;
+
+/* One measurement, taken from the fastest of the repeated runs. */
+typedef struct {
+    double secs;
+    long long counters[PERF_NUM_EVENTS];
+    long long tsc;
+} bench_result;
+
+static FILE* out;
+static int json;
+static int rows;
+static perf_counters counters;
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long long read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (long long)__rdtsc();
+#else
+    return -1;
+#endif
+}
+
+/*
+ * measure - Repeats a case until MIN_TIME has passed and keeps the counters
+ * of the fastest run.
+ */
+static bench_result measure(const bench_case* bc)
+{
+    bench_result best;
+    double start;
+    int runs = 0;
+
+    best.secs = 1e30;
+    bc->run(bc->ctx);  // Warm up caches and the thread pool.
+    start = now();
+    while (runs < 3 || now() - start < MIN_TIME)
+    {
+        bench_result r;
+        long long tsc = read_tsc();
+        double t = now();
+
+        perf_start(&counters);
+        bc->run(bc->ctx);
+        perf_stop(&counters, r.counters);
+        r.secs = now() - t;
+        r.tsc = (tsc >= 0) ? read_tsc() - tsc : -1;
+
+        if (r.secs < best.secs)
+            best = r;
+        runs++;
+    }
+    return best;
+}
+
+/*
+ * report - Writes one result row. CPE comes from the cycle counter when
+ * perf has one, else from the TSC. Every event from PERF_CACHE_MISSES on
+ * gets its own column, empty (or null) where the event is unavailable.
+ */
+static void report(const bench_case* bc, int dim, int ok, const bench_result* r)
+{
+    double elems = (double)dim * dim;
+    double bytes = 2.0 * elems * (bc->pixel_bytes ? bc->pixel_bytes : (int)sizeof(pixel));  // Read once, written once
+    long long cycles = (r->counters[PERF_CYCLES] >= 0) ? r->counters[PERF_CYCLES] : r->tsc;
+    double cpe = (cycles >= 0) ? cycles / elems : -1.0;
+    double gbps = bytes / r->secs / 1e9;
+    int e;
+
+    if (json)
+    {
+        fprintf(out, "%s\n  {\"kernel\": \"%s\", \"variant\": \"%s\", \"dim\": %d, \"ok\": %s, "
+                "\"seconds\": %.9f, \"cpe\": %.3f, \"cycle_source\": \"%s\", \"gbps\": %.3f",
+                rows ? "," : "", bc->kernel, bc->name, dim, ok ? "true" : "false",
+                r->secs, cpe, (r->counters[PERF_CYCLES] >= 0) ? "perf" : "tsc", gbps);
+        for (e = PERF_CACHE_MISSES; e < PERF_NUM_EVENTS; e++)
+            if (r->counters[e] >= 0)
+                fprintf(out, ", \"%s\": %lld", perf_event_name(e), r->counters[e]);
+            else
+                fprintf(out, ", \"%s\": null", perf_event_name(e));
+        fprintf(out, "}");
+    }
+    else
+    {
+        fprintf(out, "%s,%s,%d,%s,%.9f,%.3f,%s,%.3f", bc->kernel, bc->name, dim, ok ? "ok" : "WRONG",
+                r->secs, cpe, (r->counters[PERF_CYCLES] >= 0) ? "perf" : "tsc", gbps);
+        for (e = PERF_CACHE_MISSES; e < PERF_NUM_EVENTS; e++)
+            if (r->counters[e] >= 0)
+                fprintf(out, ",%lld", r->counters[e]);
+            else
+                fprintf(out, ",");
+        fprintf(out, "\n");
+    }
+    fflush(out);
+    rows++;
+}
+
+
+/* Context for the plain (int dim, pixel* src, pixel* dst) variants. */
+typedef struct {
+    void (*fn)(int, pixel*, pixel*);
+    int dim;
+    pixel* src;
+    pixel* dst;
+} plain_ctx;
+
+static void run_plain(void* p)
+{
+    plain_ctx* c = p;
+    c->fn(c->dim, c->src, c->dst);
+}
+
+/* Context for the planar kernels, timed without the layout conversions. */
+typedef struct {
+    void (*fn)(const planar_image*, planar_image*);
+    planar_image* src;
+    planar_image* dst;
+} planar_ctx;
+
+static void run_planar(void* p)
+{
+    planar_ctx* c = p;
+    c->fn(c->src, c->dst);
+}
+
+/*
+ * bench_plain - Checks a plain variant against ref, then times it.
+ */
+static void bench_plain(const char* kernel, const char* descr, void (*fn)(int, pixel*, pixel*),
+                        int dim, pixel* src, pixel* dst, const pixel* ref)
+{
+    char name[64];
+    plain_ctx ctx = { fn, dim, src, dst };
+    bench_case bc = { kernel, name, run_plain, &ctx, 0 };
+    bench_result r;
+    int ok;
+
+    snprintf(name, sizeof(name), "%.*s", (int)strcspn(descr, ":"), descr);
+    memset(dst, 0, sizeof(pixel) * dim * dim);
+    fn(dim, src, dst);
+    ok = !memcmp(dst, ref, sizeof(pixel) * dim * dim);
+
+    r = measure(&bc);
+    report(&bc, dim, ok, &r);
+}
+
+/*
+ * bench_planar - Times a planar kernel on data that's already planar, and
+ * checks it by converting its output back.
+ */
+static void bench_planar(const char* kernel, const char* name, void (*fn)(const planar_image*, planar_image*),
+                         int dim, planar_image* psrc, planar_image* pdst, pixel* dst, const pixel* ref)
+{
+    planar_ctx ctx = { fn, psrc, pdst };
+    bench_case bc = { kernel, name, run_planar, &ctx, 0 };
+    bench_result r;
+    int ok;
+
+    fn(psrc, pdst);
+    planar_to_pixel(pdst, dst);
+    ok = !memcmp(dst, ref, sizeof(pixel) * dim * dim);
+
+    r = measure(&bc);
+    report(&bc, dim, ok, &r);
+}
+
+/* Context for complex_inplace, which reruns on its own output each time. */
+typedef struct {
+    int dim;
+    pixel* img;
+} inplace_ctx;
+
+static void run_inplace(void* p)
+{
+    inplace_ctx* c = p;
+    complex_inplace(c->dim, c->img);
+}
+
+/*
+ * bench_inplace - Checks complex_inplace on a copy of src, then times it
+ * without the copy. Later runs convert an already converted image, which
+ * costs the same.
+ */
+static void bench_inplace(int dim, const pixel* src, pixel* dst, const pixel* ref)
+{
+    inplace_ctx ctx = { dim, dst };
+    bench_case bc = { "complex", "complex_inplace(no copy)", run_inplace, &ctx, 0 };
+    bench_result r;
+    int ok;
+
+    memcpy(dst, src, sizeof(pixel) * dim * dim);
+    complex_inplace(dim, dst);
+    ok = !memcmp(dst, ref, sizeof(pixel) * dim * dim);
+
+    r = measure(&bc);
+    report(&bc, dim, ok, &r);
+}
+
+/* Context for the 8-bit kernels, timed on data that's already RGBX32. */
+typedef struct {
+    void (*fn)(int, const pixel8*, pixel8*);
+    int dim;
+    pixel8* src;
+    pixel8* dst;
+} pixel8_ctx;
+
+static void run_pixel8(void* p)
+{
+    pixel8_ctx* c = p;
+    c->fn(c->dim, c->src, c->dst);
+}
+
+/*
+ * bench_pixel8 - Runs complex8/motion8 on an 8-bit copy of src and checks
+ * them against the naive 16-bit kernels on the same 8-bit values, which
+ * they must match exactly.
+ */
+static void bench_pixel8(int dim, const pixel* src)
+{
+    size_t n = (size_t)dim * dim, k;
+    pixel* in = malloc(sizeof(pixel) * n);
+    pixel* ref = malloc(sizeof(pixel) * n);
+    pixel* out16 = malloc(sizeof(pixel) * n);
+    pixel8* in8 = malloc(sizeof(pixel8) * n);
+    pixel8* out8 = malloc(sizeof(pixel8) * n);
+    int f;
+
+    if (!in || !ref || !out16 || !in8 || !out8)
+    {
+        fprintf(stderr, "bench: out of memory at dim %d\n", dim);
+        exit(1);
+    }
+    for (k = 0; k < n; k++)
+    {
+        in[k].red = src[k].red & 0xFF;
+        in[k].green = src[k].green & 0xFF;
+        in[k].blue = src[k].blue & 0xFF;
+    }
+    pixel_to_pixel8(dim, in, in8);
+
+    for (f = 0; f < 2; f++)
+    {
+        pixel8_ctx ctx = { f ? motion8 : complex8, dim, in8, out8 };
+        bench_case bc = { f ? "motion" : "complex", f ? "motion8(rgbx32)" : "complex8(rgbx32)",
+                          run_pixel8, &ctx, (int)sizeof(pixel8) };
+        bench_result r;
+        int ok;
+
+        (f ? naive_motion : naive_complex)(dim, in, ref);
+        ctx.fn(dim, in8, out8);
+        pixel8_to_pixel(dim, out8, out16);
+        ok = !memcmp(out16, ref, sizeof(pixel) * n);
+
+        r = measure(&bc);
+        report(&bc, dim, ok, &r);
+    }
+
+    free(in);
+    free(ref);
+    free(out16);
+    free(in8);
+    free(out8);
+}
+
+
+static void bench_dim(int dim)
+{
+    size_t n = (size_t)dim * dim, k;
+    pixel* src = malloc(sizeof(pixel) * n);
+    pixel* dst = malloc(sizeof(pixel) * n);
+    pixel* ref = malloc(sizeof(pixel) * n);
+    pixel* tmp = malloc(sizeof(pixel) * n);
+    pixel* hsrc = image_alloc(dim, IMAGE_HUGE_FLAGS);
+    pixel* hdst = image_alloc(dim, IMAGE_HUGE_FLAGS);
+    planar_image psrc, pdst;
+    int f;
+
+    if (!src || !dst || !ref || !tmp || planar_alloc(&psrc, dim) || planar_alloc(&pdst, dim))
+    {
+        fprintf(stderr, "bench: out of memory at dim %d\n", dim);
+        exit(1);
+    }
+    for (k = 0; k < n; k++)
+    {
+        src[k].red = (unsigned short)rand();
+        src[k].green = (unsigned short)rand();
+        src[k].blue = (unsigned short)rand();
+    }
+    pixel_to_planar(dim, src, &psrc);
+    if (hsrc)
+        memcpy(hsrc, src, sizeof(pixel) * n);
+
+    naive_complex(dim, src, ref);
+    for (f = 0; f < num_complex; f++)
+        bench_plain("complex", complex_descrs[f], complex_funcs[f], dim, src, dst, ref);
+    bench_planar("complex", "complex_planar(no conversion)", complex_planar, dim, &psrc, &pdst, dst, ref);
+    bench_inplace(dim, src, dst, ref);
+    if (hsrc && hdst)
+        bench_plain("complex", "complex(huge pages)", complex, dim, hsrc, hdst, ref);
+
+    naive_motion(dim, ref, tmp);  // Reference for the fused pipeline: motion(complex(src))
+    bench_plain("complex+motion", "complex_motion(fused)", complex_motion, dim, src, dst, tmp);
+
+    naive_motion(dim, src, ref);
+    for (f = 0; f < num_motion; f++)
+        bench_plain("motion", motion_descrs[f], motion_funcs[f], dim, src, dst, ref);
+    bench_planar("motion", "motion_planar(no conversion)", motion_planar, dim, &psrc, &pdst, dst, ref);
+    if (hsrc && hdst)
+        bench_plain("motion", "motion(huge pages)", motion, dim, hsrc, hdst, ref);
+
+    bench_pixel8(dim, src);
+
+    image_free(hsrc, dim);
+    image_free(hdst, dim);
+    planar_free(&psrc);
+    planar_free(&pdst);
+    free(src);
+    free(dst);
+    free(ref);
+    free(tmp);
+}
+
+int main(int argc, char** argv)
+{
+    int dims[MAX_DIMS], ndims = 0, opt, d;
+
+    out = stdout;
+    while ((opt = getopt(argc, argv, "f:d:o:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            json = !strcmp(optarg, "json");
+            break;
+        case 'd':
+            for (char* p = optarg; *p && ndims < MAX_DIMS; )
+            {
+                dims[ndims++] = (int)strtol(p, &p, 10);
+                while (*p == ',')
+                    p++;
+            }
+            break;
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL)
+            {
+                perror(optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+        {
+            long bad = recip_check();
+            printf("recip_check: %ld mismatches over divisors 1..%d, sums 0..%u\n",
+                   bad, RECIP_MAX_DIV, RECIP_MAX_SUM);
+            exit(bad != 0);
+        }
+        default:
+            fprintf(stderr, "usage: %s [-f csv|json] [-d dim,dim,...] [-o file] [-r]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (ndims == 0)
+        for (ndims = 0; ndims < (int)(sizeof(default_dims) / sizeof(int)); ndims++)
+            dims[ndims] = default_dims[ndims];
+
+    register_complex_functions();
+    register_motion_functions();
+    perf_open(&counters);
+    for (d = 0; d < PERF_NUM_EVENTS; d++)
+        if (!perf_available(&counters, d))
+            fprintf(stderr, "bench: perf event '%s' unavailable, reporting it as empty\n", perf_event_name(d));
+
+    if (json)
+        fprintf(out, "[");
+    else
+    {
+        fprintf(out, "kernel,variant,dim,ok,seconds,cpe,cycle_source,gbps");
+        for (d = PERF_CACHE_MISSES; d < PERF_NUM_EVENTS; d++)
+            fprintf(out, ",%s", perf_event_name(d));
+        fprintf(out, "\n");
+    }
+
+    for (d = 0; d < ndims; d++)
+        if (dims[d] >= 3)
+            bench_dim(dims[d]);
+
+    if (json)
+        fprintf(out, "\n]\n");
+
+    perf_close(&counters);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
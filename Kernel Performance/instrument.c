@@ -0,0 +1,202 @@
+/*
+ * instrument.c - Per-call perf counters around registered kernel variants.
+ *
+ * Function pointers carry no context, so each wrapped variant gets one of a
+ * fixed set of trampolines that knows its slot number. Counts are summed per
+ * (variant, dim) and reported per pixel, which is what tells two variants
+ * apart: same cycles but fewer instructions means it went memory bound, same
+ * instructions but more LLC or dTLB misses means the access order got worse.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "instrument.h"
+#include "perfctr.h"
+
+#define INSTRUMENT_SLOTS 64
+#define INSTRUMENT_DIMS  32     // Distinct dims tracked per variant
+
+/* Totals for one variant at one dim. */
+typedef struct {
+    int dim;
+    long calls;
+    double secs;
+    long long counts[PERF_NUM_EVENTS];  // -1 if the event is unavailable
+} dim_stats;
+
+static struct {
+    const char* kernel;
+    char name[64];
+    instrumented_func fn;
+    int ndims;
+    dim_stats dims[INSTRUMENT_DIMS];
+} slots[INSTRUMENT_SLOTS];
+
+static int nslots;
+static perf_counters counters;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The stats of slot k for dim, created on first use; NULL when full. */
+static dim_stats* stats_for(int k, int dim)
+{
+    int d, e;
+
+    for (d = 0; d < slots[k].ndims; d++)
+        if (slots[k].dims[d].dim == dim)
+            return &slots[k].dims[d];
+    if (slots[k].ndims == INSTRUMENT_DIMS)
+        return NULL;
+
+    d = slots[k].ndims++;
+    slots[k].dims[d].dim = dim;
+    slots[k].dims[d].calls = 0;
+    slots[k].dims[d].secs = 0;
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+        slots[k].dims[d].counts[e] = 0;
+    return &slots[k].dims[d];
+}
+
+/*
+ * instrument_call - Runs slot k's variant under the counters.
+ */
+static void instrument_call(int k, int dim, pixel* src, pixel* dst)
+{
+    long long values[PERF_NUM_EVENTS];
+    dim_stats* st;
+    double t;
+    int e;
+
+    t = now();
+    perf_start(&counters);
+    slots[k].fn(dim, src, dst);
+    perf_stop(&counters, values);
+    t = now() - t;
+
+    if ((st = stats_for(k, dim)) == NULL)
+        return;
+    st->calls++;
+    st->secs += t;
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+        st->counts[e] = (values[e] < 0 || st->counts[e] < 0) ? -1 : st->counts[e] + values[e];
+}
+
+#define TRAMPOLINE(k) \
+static void trampoline##k(int dim, pixel* src, pixel* dst) { instrument_call(k, dim, src, dst); }
+
+TRAMPOLINE(0) TRAMPOLINE(1) TRAMPOLINE(2) TRAMPOLINE(3) TRAMPOLINE(4) TRAMPOLINE(5) TRAMPOLINE(6) TRAMPOLINE(7)
+TRAMPOLINE(8) TRAMPOLINE(9) TRAMPOLINE(10) TRAMPOLINE(11) TRAMPOLINE(12) TRAMPOLINE(13) TRAMPOLINE(14) TRAMPOLINE(15)
+TRAMPOLINE(16) TRAMPOLINE(17) TRAMPOLINE(18) TRAMPOLINE(19) TRAMPOLINE(20) TRAMPOLINE(21) TRAMPOLINE(22) TRAMPOLINE(23)
+TRAMPOLINE(24) TRAMPOLINE(25) TRAMPOLINE(26) TRAMPOLINE(27) TRAMPOLINE(28) TRAMPOLINE(29) TRAMPOLINE(30) TRAMPOLINE(31)
+TRAMPOLINE(32) TRAMPOLINE(33) TRAMPOLINE(34) TRAMPOLINE(35) TRAMPOLINE(36) TRAMPOLINE(37) TRAMPOLINE(38) TRAMPOLINE(39)
+TRAMPOLINE(40) TRAMPOLINE(41) TRAMPOLINE(42) TRAMPOLINE(43) TRAMPOLINE(44) TRAMPOLINE(45) TRAMPOLINE(46) TRAMPOLINE(47)
+TRAMPOLINE(48) TRAMPOLINE(49) TRAMPOLINE(50) TRAMPOLINE(51) TRAMPOLINE(52) TRAMPOLINE(53) TRAMPOLINE(54) TRAMPOLINE(55)
+TRAMPOLINE(56) TRAMPOLINE(57) TRAMPOLINE(58) TRAMPOLINE(59) TRAMPOLINE(60) TRAMPOLINE(61) TRAMPOLINE(62) TRAMPOLINE(63)
+
+static const instrumented_func trampolines[INSTRUMENT_SLOTS] = {
+    trampoline0, trampoline1, trampoline2, trampoline3, trampoline4, trampoline5, trampoline6, trampoline7,
+    trampoline8, trampoline9, trampoline10, trampoline11, trampoline12, trampoline13, trampoline14, trampoline15,
+    trampoline16, trampoline17, trampoline18, trampoline19, trampoline20, trampoline21, trampoline22, trampoline23,
+    trampoline24, trampoline25, trampoline26, trampoline27, trampoline28, trampoline29, trampoline30, trampoline31,
+    trampoline32, trampoline33, trampoline34, trampoline35, trampoline36, trampoline37, trampoline38, trampoline39,
+    trampoline40, trampoline41, trampoline42, trampoline43, trampoline44, trampoline45, trampoline46, trampoline47,
+    trampoline48, trampoline49, trampoline50, trampoline51, trampoline52, trampoline53, trampoline54, trampoline55,
+    trampoline56, trampoline57, trampoline58, trampoline59, trampoline60, trampoline61, trampoline62, trampoline63
+};
+
+static void report_at_exit(void)
+{
+    instrument_report(stderr);
+}
+
+/*
+ * instrument_wrap - Claims the next slot for fn. The first call opens the
+ * counters and arranges for the report at exit.
+ */
+instrumented_func instrument_wrap(const char* kernel, const char* descr, instrumented_func fn)
+{
+    int k;
+
+    if (nslots == INSTRUMENT_SLOTS)
+        return fn;
+    if (nslots == 0)
+    {
+        perf_open(&counters);
+        atexit(report_at_exit);
+    }
+
+    k = nslots++;
+    slots[k].kernel = kernel;
+    slots[k].fn = fn;
+    slots[k].ndims = 0;
+    snprintf(slots[k].name, sizeof(slots[k].name), "%.*s", (int)strcspn(descr, ":"), descr);
+    return trampolines[k];
+}
+
+/* Prints count per pixel per call, or "-" if the event wasn't counted. */
+static void print_rate(FILE* out, long long count, double pixels)
+{
+    if (count < 0)
+        fprintf(out, " %17s", "-");
+    else
+        fprintf(out, " %17.4f", count / pixels);
+}
+
+static int cmp_int(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/*
+ * instrument_report - One table per dim, one row per variant that ran at
+ * it, with every counter averaged per call and divided by dim * dim.
+ */
+void instrument_report(FILE* out)
+{
+    int dims[INSTRUMENT_SLOTS * INSTRUMENT_DIMS], ndims = 0;
+    int k, d, i, e;
+
+    for (k = 0; k < nslots; k++)
+        for (d = 0; d < slots[k].ndims; d++)
+        {
+            for (i = 0; i < ndims && dims[i] != slots[k].dims[d].dim; i++)
+                ;
+            if (i == ndims)
+                dims[ndims++] = slots[k].dims[d].dim;
+        }
+    qsort(dims, ndims, sizeof(int), cmp_int);
+
+    for (i = 0; i < ndims; i++)
+    {
+        fprintf(out, "\ndim %d (per pixel per call)\n%-8s %-24s %6s %12s %6s", dims[i], "kernel", "variant",
+                "calls", "ns", "ipc");
+        for (e = 0; e < PERF_NUM_EVENTS; e++)
+            fprintf(out, " %17s", perf_event_name(e));
+        fprintf(out, "\n");
+
+        for (k = 0; k < nslots; k++)
+            for (d = 0; d < slots[k].ndims; d++)
+            {
+                const dim_stats* st = &slots[k].dims[d];
+                double pixels = (double)st->dim * st->dim * st->calls;
+
+                if (st->dim != dims[i] || st->calls == 0)
+                    continue;
+                fprintf(out, "%-8s %-24.24s %6ld %12.4f", slots[k].kernel, slots[k].name, st->calls,
+                        st->secs * 1e9 / pixels);
+                if (st->counts[PERF_CYCLES] > 0 && st->counts[PERF_INSTRUCTIONS] >= 0)
+                    fprintf(out, " %6.2f", (double)st->counts[PERF_INSTRUCTIONS] / st->counts[PERF_CYCLES]);
+                else
+                    fprintf(out, " %6s", "-");
+                for (e = 0; e < PERF_NUM_EVENTS; e++)
+                    print_rate(out, st->counts[e], pixels);
+                fprintf(out, "\n");
+            }
+    }
+}
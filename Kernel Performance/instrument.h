@@ -0,0 +1,29 @@
+/*
+ * instrument.h - Per-call hardware counters around registered kernels.
+ *
+ * instrument_wrap hands back a stand-in for a kernel variant that runs it
+ * between perf_start/perf_stop and files the counts under its dim. When
+ * kernels.c is built with -DKERNELS_INSTRUMENT every variant it registers
+ * goes through here, so the lab driver itself collects the numbers:
+ *
+ *   gcc -O2 -DKERNELS_INSTRUMENT driver.c kernels.c instrument.c perfctr.c -lpthread
+ *
+ * A per-dim summary goes to stderr at exit.
+ */
+#ifndef _INSTRUMENT_H_
+#define _INSTRUMENT_H_
+
+#include <stdio.h>
+#include "defs.h"
+
+typedef void (*instrumented_func)(int, pixel*, pixel*);
+
+/*
+ * Returns a wrapper for fn, labelled with the kernel name and the part of
+ * descr before its ':'. Once every wrapper slot is taken, returns fn itself.
+ */
+instrumented_func instrument_wrap(const char* kernel, const char* descr, instrumented_func fn);
+
+void instrument_report(FILE* out);     /* Per-dim table of every wrapped variant */
+
+#endif /* _INSTRUMENT_H_ */
@@ -2,12 +2,45 @@
  * Solutions for the CS:APP Performance Lab
  ********************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE     // pthread_setaffinity_np, CPU_SET
+#include <sched.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "defs.h"
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#ifdef KERNELS_INSTRUMENT
+#include "instrument.h"
+/* Register every variant behind a perf-counting wrapper (see instrument.h). */
+#define add_complex_function(f, descr) add_complex_function(instrument_wrap("complex", (descr), (f)), (descr))
+#define add_motion_function(f, descr) add_motion_function(instrument_wrap("motion", (descr), (f)), (descr))
+#endif
 
 #define TILE 8  // Tile size for loop tiling.
 
+/* Variants defined below the register_* functions that list them. */
+extern char complex_soa_descr[], motion_soa_descr[], motion_conv3_descr[], complex_inplace_descr[];
+extern char motion_ghosted_descr[], complex_fixed_descr[], motion_fixed_descr[];
+void complex_soa(int, pixel*, pixel*);
+void complex_inplace_copy(int, pixel*, pixel*);
+void motion_soa(int, pixel*, pixel*);
+void motion_conv3(int, pixel*, pixel*);
+void motion_ghosted(int, pixel*, pixel*);
+void complex_fixed(int, pixel*, pixel*);
+void motion_fixed(int, pixel*, pixel*);
+
  /*
   * Please fill in the following student struct
   */
@@ -16,6 +49,335 @@ student_t student = {
   "scott@utah.edu",  /* Email address */
 };
 
+/************************
+ * RECIPROCAL DIVISION
+ ************************/
+
+/*
+ * The kernels only ever divide channel sums by 1..9: 3 for complex and the
+ * 9/6/4/3/2/1 clipped windows of motion. Each divisor d gets a multiplier
+ * M = ceil(2^32 / d) with n / d == (n * M) >> 32. Writing M * d = 2^32 + e
+ * with 0 <= e < d, n * M / 2^32 = n / d + n * e / (d * 2^32), which stays
+ * below the next multiple of 1/d while n * e < 2^32. That holds for every
+ * n < 2^29, far above the largest sum, 9 * 65535 (RECIP_MAX_SUM).
+ * recip_check() confirms it exhaustively.
+ */
+#define RECIP(d) ((((unsigned long long)1 << 32) + (d) - 1) / (d))
+
+static const unsigned long long recip_table[RECIP_MAX_DIV + 1] = {
+    0, RECIP(1), RECIP(2), RECIP(3), RECIP(4), RECIP(5), RECIP(6), RECIP(7), RECIP(8), RECIP(9)
+};
+
+/* n / d for 1 <= d <= RECIP_MAX_DIV and n <= RECIP_MAX_SUM, without a divide. */
+static inline unsigned int div_small(unsigned int n, unsigned int d)
+{
+    return (unsigned int)(((unsigned long long)n * recip_table[d]) >> 32);
+}
+
+/***************
+ * THREAD POOL
+ ***************/
+
+/* One work item of a parallel call. */
+typedef void (*pool_task)(void* arg, int item);
+
+/*
+ * Persistent worker pool. A call splits its items into one contiguous share
+ * per participating thread (the caller takes share 0), so the same thread
+ * always gets the same part of the image for a given dim and thread count.
+ * On Linux worker t, which runs share t + 1, is pinned to the (t + 1)th CPU
+ * the process may use, so that part also stays on one CPU and NUMA node.
+ * The caller can be pinned to the 0th for a call (pool_call) as well.
+ */
+static struct {
+    pthread_mutex_t lock;       // Protects everything below
+    pthread_cond_t start;       // Signalled when a new job is posted
+    pthread_cond_t done;        // Signalled when the last worker finishes
+    pthread_mutex_t call_lock;  // Serializes concurrent pool_run callers
+    pthread_t* threads;
+    int nworkers;               // Worker threads (not counting the caller)
+    int generation;             // Bumped once per job
+    int pending;                // Workers still running the current job
+    int quit;
+
+    pool_task task;             // Current job
+    void* arg;
+    int nitems;
+    int nshares;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, NULL, NULL, 0, 0 };
+
+static int kernel_threads = 0;  // <= 0 means one per online CPU
+static int complex_block_size = 64;
+static int motion_band_rows = 32;
+
+/*
+ * pool_share - Runs share 'share' of the current job's items.
+ */
+static void pool_share(pool_task task, void* arg, int nitems, int nshares, int share)
+{
+    int first = (int)((long)nitems * share / nshares);
+    int last = (int)((long)nitems * (share + 1) / nshares);
+    int k;
+
+    for (k = first; k < last; k++)
+        task(arg, k);
+}
+
+/*
+ * pool_worker - Sleeps until a job is posted, runs its share, reports back.
+ */
+static void* pool_worker(void* idp)
+{
+    int id = (int)(long)idp;
+    int seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        while (pool.generation == seen && !pool.quit)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        if (pool.quit)
+            break;
+        seen = pool.generation;
+
+        pool_task task = pool.task;
+        void* arg = pool.arg;
+        int nitems = pool.nitems, nshares = pool.nshares;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (id + 1 < nshares)
+            pool_share(task, arg, nitems, nshares, id + 1);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/*
+ * pool_stop - Joins every worker. Caller holds call_lock.
+ */
+static void pool_stop(void)
+{
+    int t;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (t = 0; t < pool.nworkers; t++)
+        pthread_join(pool.threads[t], NULL);
+
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.nworkers = 0;
+    pool.generation = 0;
+    pool.quit = 0;
+}
+
+/*
+ * pool_pin - Pins thread to the CPU in allowed that runs the given share,
+ * the share'th one, wrapping around if there are more shares than CPUs.
+ * Best effort: a thread left unpinned still runs its share, just without a
+ * fixed home.
+ */
+static void pool_pin(pthread_t thread, int share, const void* allowed)
+{
+#ifdef __linux__
+    const cpu_set_t* set = allowed;
+    int ncpus = CPU_COUNT(set), want, cpu;
+    cpu_set_t one;
+
+    if (ncpus == 0)
+        return;
+    want = share % ncpus;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, set) && want-- == 0)
+            break;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    pthread_setaffinity_np(thread, sizeof(one), &one);
+#else
+    (void)thread;
+    (void)share;
+    (void)allowed;
+#endif
+}
+
+/*
+ * pool_resize - Tries to make sure there are at least n - 1 workers; if the
+ * thread array can't be allocated the current workers are kept. Caller
+ * holds call_lock.
+ */
+static void pool_resize(int n)
+{
+    pthread_t* threads;
+    int t;
+#ifdef __linux__
+    cpu_set_t allowed;
+#else
+    int allowed = 0;
+#endif
+
+    if (n - 1 <= pool.nworkers)
+        return;
+    if ((threads = malloc(sizeof(pthread_t) * (n - 1))) == NULL)
+        return;
+#ifdef __linux__
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+#endif
+
+    pool_stop();
+    pool.threads = threads;
+    for (t = 0; t < n - 1; t++)
+    {
+        if (pthread_create(&pool.threads[t], NULL, pool_worker, (void*)(long)t) != 0)
+            break;
+        pool_pin(pool.threads[t], t + 1, &allowed);
+        pool.nworkers++;
+    }
+}
+
+/*
+ * online_cpus - Number of CPUs the pool sizes itself to by default.
+ */
+static int online_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+/*
+ * pool_call - Runs task(arg, k) for k in [0, nitems) on nthreads threads,
+ * the caller included, and returns once every item is done. Uses fewer
+ * threads, down to just the caller, if the pool couldn't grow. With
+ * pin_caller set the caller is pinned to share 0's CPU, the first one it may
+ * use, while it runs that share, and gets its own affinity back afterwards.
+ * That is done after pool_resize, which hands new workers the caller's mask.
+ */
+static void pool_call(pool_task task, void* arg, int nitems, int nthreads, int pin_caller)
+{
+#ifdef __linux__
+    cpu_set_t saved;
+    int pinned = 0;
+#endif
+
+    if (nthreads <= 0)
+        nthreads = online_cpus();
+    if (nthreads > nitems)
+        nthreads = nitems;
+    if (nthreads <= 1)
+    {
+        pool_share(task, arg, nitems, 1, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.call_lock);
+    pool_resize(nthreads);
+    if (nthreads > pool.nworkers + 1)
+        nthreads = pool.nworkers + 1;
+    if (nthreads <= 1)
+    {
+        pthread_mutex_unlock(&pool.call_lock);
+        pool_share(task, arg, nitems, 1, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.task = task;
+    pool.arg = arg;
+    pool.nitems = nitems;
+    pool.nshares = nthreads;
+    pool.pending = pool.nworkers;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+#ifdef __linux__
+    if (pin_caller && pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0)
+    {
+        pool_pin(pthread_self(), 0, &saved);
+        pinned = 1;
+    }
+#endif
+    pool_share(task, arg, nitems, nthreads, 0);
+#ifdef __linux__
+    if (pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+#else
+    (void)pin_caller;
+#endif
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.call_lock);
+}
+
+/*
+ * pool_run - pool_call with the caller left wherever it is running.
+ */
+static void pool_run(pool_task task, void* arg, int nitems, int nthreads)
+{
+    pool_call(task, arg, nitems, nthreads, 0);
+}
+
+void set_kernel_threads(int n) { kernel_threads = n; }
+int get_kernel_threads(void) { return (kernel_threads > 0) ? kernel_threads : online_cpus(); }
+void set_complex_block(int size) { complex_block_size = (size > 0) ? size : 64; }
+int get_complex_block(void) { return complex_block_size; }
+void set_motion_band(int rows) { motion_band_rows = (rows > 0) ? rows : 32; }
+int get_motion_band(void) { return motion_band_rows; }
+
+
+/***************
+ * TUNING PROFILE
+ ***************/
+
+#define PROFILE_MAX 64  // Entries per kernel.
+
+/* One line of the profile: the winning variant and knobs for a dim. */
+typedef struct {
+    int dim;
+    const kernel_variant* variant;
+    int threads;
+    int block;
+} profile_entry;
+
+static profile_entry profile[2][PROFILE_MAX];  // Indexed by KERNEL_COMPLEX / KERNEL_MOTION
+static int profile_count[2];
+
+/*
+ * profile_pick - Profile entry for dim: the exact dim if it was tuned,
+ * otherwise the tuned dim closest to it by ratio. NULL if none loaded.
+ */
+static const profile_entry* profile_pick(int kernel, int dim)
+{
+    const profile_entry* best = NULL;
+    double best_ratio = 0.0;
+    int k;
+
+    for (k = 0; k < profile_count[kernel]; k++)
+    {
+        const profile_entry* e = &profile[kernel][k];
+        double ratio = (e->dim < dim) ? (double)e->dim / dim : (double)dim / e->dim;
+
+        if (ratio > best_ratio)
+        {
+            best = e;
+            best_ratio = ratio;
+        }
+    }
+    return best;
+}
+
+
 /***************
  * COMPLEX KERNEL
  ***************/
@@ -133,132 +495,813 @@ void naive_complex(int dim, pixel* src, pixel* dest)
 
 
 /*
- * complex - Your current working version of complex
- * IMPORTANT: This is the version you will be graded on
+ * complex_gray - Grayscale value of a single pixel.
  */
-char complex_descr[] = "complex: Current working version";
-void complex(int dim, pixel* src, pixel* dest)
+static inline unsigned short complex_gray(pixel p)
+{
+    return (unsigned short)div_small((unsigned int)p.red + p.green + p.blue, 3);
+}
+
+
+/*
+ * complex_block - Scalar grayscale + rotate of an h x w block.
+ * s points at the top-left pixel of the block in src and d at the top-left
+ * pixel of its rotated (w x h) image in dest. Local pixel (r, c) of the block
+ * lands on local pixel (w-1-c, h-1-r) of the rotated image.
+ */
+static void complex_block(const pixel* s, int sstride, pixel* d, int dstride, int h, int w)
 {
-    int i, j, ii, jj;
+    int r, c;
 
-    for (i = 0; i < dim; i += TILE)
-        for (j = 0; j < dim; j += TILE)
-            for (ii = i; ii < i + TILE; ii++)
-                for (jj = j; jj < j + TILE; jj++)
-                {
-                    pixel next = src[RIDX(ii, jj, dim)];
-                    unsigned int val = (unsigned int)next.red + (unsigned int)next.green + (unsigned int)next.blue;
-                    val = val / 3;
-                    int index = RIDX(dim - jj - 1, dim - ii - 1, dim);
-                    dest[index].red = (unsigned short)val;
-                    dest[index].green = (unsigned short)val;
-                    dest[index].blue = (unsigned short)val;
-                }
+    for (r = 0; r < h; r++)
+        for (c = 0; c < w; c++)
+        {
+            unsigned short val = complex_gray(s[RIDX(r, c, sstride)]);
+            pixel* out = &d[RIDX(w - 1 - c, h - 1 - r, dstride)];
+            out->red = val;
+            out->green = val;
+            out->blue = val;
+        }
 }
 
-/*********************************************************************
- * register_complex_functions - Register all of your different versions
- *     of the complex kernel with the driver by calling the
- *     add_complex_function() for each test function. When you run the
- *     driver program, it will test and report the performance of each
- *     registered test function.
- *********************************************************************/
 
-void register_complex_functions() {
-    add_complex_function(&complex, complex_descr);
-    add_complex_function(&naive_complex, naive_complex_descr);
-    //add_complex_function(&my_complex_v1, my_complex_v1_descr);
-    //add_complex_function(&my_complex_v2, my_complex_v2_descr);
-    //add_complex_function(&my_complex_v3, my_complex_v3_descr);
+/* Top-left of the rotated image of sub-block (i, j, h, w) inside an H x W region. */
+#define ROT_DEST(d, dstride, H, W, i, j, h, w) ((d) + RIDX((W) - (j) - (w), (H) - (i) - (h), (dstride)))
+
+/* A full tile x tile kernel and a whole-region kernel, both in complex_block's terms. */
+typedef void (*complex_tile_func)(const pixel*, int, pixel*, int);
+typedef void (*complex_region_func)(const pixel*, int, pixel*, int, int, int);
+
+
+/*
+ * complex_region - Covers an h x w region with tile x tile blocks. Full tiles go
+ * to tile_fn, the ragged right/bottom edges fall back to complex_block.
+ */
+static void complex_region(const pixel* s, int sstride, pixel* d, int dstride,
+                           int h, int w, int tile, complex_tile_func tile_fn)
+{
+    int i, j;
+
+    for (i = 0; i < h; i += tile)
+    {
+        int th = (h - i < tile) ? h - i : tile;
+        for (j = 0; j < w; j += tile)
+        {
+            int tw = (w - j < tile) ? w - j : tile;
+            const pixel* ts = s + RIDX(i, j, sstride);
+            pixel* td = ROT_DEST(d, dstride, h, w, i, j, th, tw);
+
+            if (th == tile && tw == tile)
+                tile_fn(ts, sstride, td, dstride);
+            else
+                complex_block(ts, sstride, td, dstride, th, tw);
+        }
+    }
 }
 
 
-/***************
- * MOTION KERNEL
- **************/
+static void complex_tile_scalar(const pixel* s, int sstride, pixel* d, int dstride)
+{
+    complex_block(s, sstride, d, dstride, TILE, TILE);
+}
 
- /***************************************************************
-  * Various helper functions for the motion kernel
-  * You may modify these or add new ones any way you like.
-  **************************************************************/
+static void complex_scalar_region(const pixel* s, int sstride, pixel* d, int dstride, int h, int w)
+{
+    complex_region(s, sstride, d, dstride, h, w, TILE, complex_tile_scalar);
+}
 
 
-  /*
-   * weighted_combo - Returns new pixel value at (i,j)
-   */
-static pixel weighted_combo(int dim, int i, int j, pixel* src)
+#ifdef HAVE_X86_SIMD
+
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+
+/* pshufb mask moving 16-bit words: lane k of the result takes word wk (-1 zeroes it). */
+#define WB(w) ((w) < 0 ? -1 : 2 * (w)), ((w) < 0 ? -1 : 2 * (w) + 1)
+#define WSHUF(w0, w1, w2, w3, w4, w5, w6, w7) \
+    _mm_setr_epi8(WB(w0), WB(w1), WB(w2), WB(w3), WB(w4), WB(w5), WB(w6), WB(w7))
+
+/*
+ * Three 128-bit loads hold 8 interleaved pixels:
+ *   v0 = r0 g0 b0 r1 g1 b1 r2 g2 | v1 = b2 r3 g3 b3 r4 g4 b4 r5 | v2 = g5 b5 r6 g6 b6 r7 g7 b7
+ * Each channel is gathered with one shuffle per load, OR'ed together.
+ */
+#define RED_V0   WSHUF( 0,  3,  6, -1, -1, -1, -1, -1)
+#define RED_V1   WSHUF(-1, -1, -1,  1,  4,  7, -1, -1)
+#define RED_V2   WSHUF(-1, -1, -1, -1, -1, -1,  2,  5)
+#define GREEN_V0 WSHUF( 1,  4,  7, -1, -1, -1, -1, -1)
+#define GREEN_V1 WSHUF(-1, -1, -1,  2,  5, -1, -1, -1)
+#define GREEN_V2 WSHUF(-1, -1, -1, -1, -1,  0,  3,  6)
+#define BLUE_V0  WSHUF( 2,  5, -1, -1, -1, -1, -1, -1)
+#define BLUE_V1  WSHUF(-1, -1,  0,  3,  6, -1, -1, -1)
+#define BLUE_V2  WSHUF(-1, -1, -1, -1, -1,  1,  4,  7)
+
+/* And back again: 8 gray words spread into 24 (g, g, g) words. */
+#define GRAY_OUT0 WSHUF(0, 0, 0, 1, 1, 1, 2, 2)
+#define GRAY_OUT1 WSHUF(2, 3, 3, 3, 4, 4, 4, 5)
+#define GRAY_OUT2 WSHUF(5, 5, 6, 6, 6, 7, 7, 7)
+
+/*
+ * TRANSPOSE8_EPI16 - In-register transpose of eight vectors of 8 words.
+ * With the _mm256 prefix it transposes both 128-bit lanes independently.
+ */
+#define TRANSPOSE8_EPI16(r, PFX, T) do {                                       \
+    T a0 = PFX##_unpacklo_epi16(r[0], r[1]), a1 = PFX##_unpackhi_epi16(r[0], r[1]); \
+    T a2 = PFX##_unpacklo_epi16(r[2], r[3]), a3 = PFX##_unpackhi_epi16(r[2], r[3]); \
+    T a4 = PFX##_unpacklo_epi16(r[4], r[5]), a5 = PFX##_unpackhi_epi16(r[4], r[5]); \
+    T a6 = PFX##_unpacklo_epi16(r[6], r[7]), a7 = PFX##_unpackhi_epi16(r[6], r[7]); \
+    T b0 = PFX##_unpacklo_epi32(a0, a2), b1 = PFX##_unpackhi_epi32(a0, a2);     \
+    T b2 = PFX##_unpacklo_epi32(a1, a3), b3 = PFX##_unpackhi_epi32(a1, a3);     \
+    T b4 = PFX##_unpacklo_epi32(a4, a6), b5 = PFX##_unpackhi_epi32(a4, a6);     \
+    T b6 = PFX##_unpacklo_epi32(a5, a7), b7 = PFX##_unpackhi_epi32(a5, a7);     \
+    r[0] = PFX##_unpacklo_epi64(b0, b4); r[1] = PFX##_unpackhi_epi64(b0, b4);   \
+    r[2] = PFX##_unpacklo_epi64(b1, b5); r[3] = PFX##_unpackhi_epi64(b1, b5);   \
+    r[4] = PFX##_unpacklo_epi64(b2, b6); r[5] = PFX##_unpackhi_epi64(b2, b6);   \
+    r[6] = PFX##_unpacklo_epi64(b3, b7); r[7] = PFX##_unpackhi_epi64(b3, b7);   \
+} while (0)
+
+
+/*
+ * div_epu32_sse41 - x / d on four 32-bit lanes through recip_table, for
+ * 2 <= d <= RECIP_MAX_DIV. The odd lanes' products already have their
+ * quotient in the high dword, so only the even lanes need a shift.
+ */
+TARGET_SSE41 static inline __m128i div_epu32_sse41(__m128i x, unsigned int d)
 {
-    int ii, jj;
-    pixel current_pixel;
+    const __m128i m = _mm_set1_epi32((int)recip_table[d]);
+    __m128i even = _mm_srli_epi64(_mm_mul_epu32(x, m), 32);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), m);
+    return _mm_blend_epi16(even, odd, 0xCC);
+}
 
-    int red, green, blue;
-    red = green = blue = 0;
+/*
+ * deinterleave8_sse41 - Splits 8 consecutive pixels into red, green and blue words.
+ */
+TARGET_SSE41 static inline void deinterleave8_sse41(const pixel* p, __m128i* r, __m128i* g, __m128i* b)
+{
+    const __m128i* q = (const __m128i*)p;
+    __m128i v0 = _mm_loadu_si128(q), v1 = _mm_loadu_si128(q + 1), v2 = _mm_loadu_si128(q + 2);
 
-    int num_neighbors = 0;
-    for (ii = 0; ii < 3; ii++)
-        for (jj = 0; jj < 3; jj++)
-            if ((i + ii < dim) && (j + jj < dim))
-            {
-                num_neighbors++;
-                red += (int)src[RIDX(i + ii, j + jj, dim)].red;
-                green += (int)src[RIDX(i + ii, j + jj, dim)].green;
-                blue += (int)src[RIDX(i + ii, j + jj, dim)].blue;
-            }
+    *r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, RED_V0), _mm_shuffle_epi8(v1, RED_V1)),
+                      _mm_shuffle_epi8(v2, RED_V2));
+    *g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, GREEN_V0), _mm_shuffle_epi8(v1, GREEN_V1)),
+                      _mm_shuffle_epi8(v2, GREEN_V2));
+    *b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, BLUE_V0), _mm_shuffle_epi8(v1, BLUE_V1)),
+                      _mm_shuffle_epi8(v2, BLUE_V2));
+}
 
-    current_pixel.red = (unsigned short)(red / num_neighbors);
-    current_pixel.green = (unsigned short)(green / num_neighbors);
-    current_pixel.blue = (unsigned short)(blue / num_neighbors);
+/*
+ * gray8_words_sse41 - (r + g + b) / 3 on 8 words per channel.
+ */
+TARGET_SSE41 static inline __m128i gray8_words_sse41(__m128i r, __m128i g, __m128i b)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(r, zero), _mm_unpacklo_epi16(g, zero)),
+                               _mm_unpacklo_epi16(b, zero));
+    __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(r, zero), _mm_unpackhi_epi16(g, zero)),
+                               _mm_unpackhi_epi16(b, zero));
 
-    return current_pixel;
+    return _mm_packus_epi32(div_epu32_sse41(lo, 3), div_epu32_sse41(hi, 3));
 }
 
+/*
+ * gray8_sse41 - Grayscale of 8 consecutive pixels as 8 words.
+ */
+TARGET_SSE41 static inline __m128i gray8_sse41(const pixel* p)
+{
+    __m128i r, g, b;
+    deinterleave8_sse41(p, &r, &g, &b);
+    return gray8_words_sse41(r, g, b);
+}
 
+/*
+ * store_gray8_sse41 - Writes 8 gray words as 8 (g, g, g) pixels.
+ */
+TARGET_SSE41 static inline void store_gray8_sse41(pixel* p, __m128i gray)
+{
+    __m128i* q = (__m128i*)p;
+    _mm_storeu_si128(q, _mm_shuffle_epi8(gray, GRAY_OUT0));
+    _mm_storeu_si128(q + 1, _mm_shuffle_epi8(gray, GRAY_OUT1));
+    _mm_storeu_si128(q + 2, _mm_shuffle_epi8(gray, GRAY_OUT2));
+}
 
-/******************************************************
- * Your different versions of the motion kernel go here
- ******************************************************/
+/*
+ * complex_tile8_sse41 - 8x8 tile. Rows are loaded bottom-up so the transpose
+ * leaves every output row already reversed, i.e. on the anti-diagonal.
+ */
+TARGET_SSE41 static void complex_tile8_sse41(const pixel* s, int sstride, pixel* d, int dstride)
+{
+    __m128i r[8];
+    int k;
 
- /*
-  * my_motion_v1 - Ver. 1 of optimizing blurring kernel.
-  * The if-statement in the nested for-loop is costly. Let's try and deal with
-  * the border pixels w/o any conditionals.
-  * ERROR ON EVERY PIXEL. TOOK AVERAGE BASED ON CENTER PIXEL. :(
-  */
-//char my_motion_v1_descr[] = "my_motion_v1: 1st attempt at optimizing motion";
-//void my_motion_v1(int dim, pixel* src, pixel* dst)
-//{
-//    pixel work;
-//    pixel* workPtr = &work;
-//
-//    int i = 0;
-//    int j = 0;         // Top-Left Pixel
-//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(0, 0, dim)].red
-//                                       + (unsigned int)src[RIDX(0, 1, dim)].red
-//                                       + (unsigned int)src[RIDX(1, 0, dim)].red
-//                                       + (unsigned int)src[RIDX(1, 1, dim)].red) / 4);
-//	workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(0, 0, dim)].green
-//								       + (unsigned int)src[RIDX(0, 1, dim)].green
-//									   + (unsigned int)src[RIDX(1, 0, dim)].green
-//									   + (unsigned int)src[RIDX(1, 1, dim)].green) / 4);
-//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(0, 0, dim)].blue
-//                                       + (unsigned int)src[RIDX(0, 1, dim)].blue
-//                                       + (unsigned int)src[RIDX(1, 0, dim)].blue
-//                                       + (unsigned int)src[RIDX(1, 1, dim)].blue) / 4);
-//    dst[RIDX(i, j, dim)] = work;
-//
-//    i = 0;
-//    j = dim - 1;       // Top-Right Pixel
-//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i  , j,   dim)].red
-//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].red
-//                                       + (unsigned int)src[RIDX(i  , j-1, dim)].red
-//                                       + (unsigned int)src[RIDX(i+1, j-1, dim)].red) / 4);
-//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].green
-//                                       + (unsigned int)src[RIDX(i,   j-1, dim)].green
-//                                       + (unsigned int)src[RIDX(i+1, j-1, dim)].green) / 4);
-//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-//                                       + (unsigned int)src[RIDX(i,   j-1, dim)].blue
+    for (k = 0; k < 8; k++)
+        r[7 - k] = gray8_sse41(s + RIDX(k, 0, sstride));
+
+    TRANSPOSE8_EPI16(r, _mm, __m128i);
+
+    for (k = 0; k < 8; k++)
+        store_gray8_sse41(d + RIDX(7 - k, 0, dstride), r[k]);
+}
+
+static void complex_sse41_region(const pixel* s, int sstride, pixel* d, int dstride, int h, int w)
+{
+    complex_region(s, sstride, d, dstride, h, w, 8, complex_tile8_sse41);
+}
+
+
+/* Same 128-bit shuffle applied to both lanes of a 256-bit register. */
+#define LANES(m) _mm256_broadcastsi128_si256(m)
+
+/*
+ * div_epu32_avx2 - div_epu32_sse41 on eight lanes.
+ */
+TARGET_AVX2 static inline __m256i div_epu32_avx2(__m256i x, unsigned int d)
+{
+    const __m256i m = _mm256_set1_epi32((int)recip_table[d]);
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(x, m), 32);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), m);
+    return _mm256_blend_epi32(even, odd, 0xAA);
+}
+
+/*
+ * gray16_words_avx2 - (r + g + b) / 3 on 16 words per channel, lane by lane.
+ */
+TARGET_AVX2 static inline __m256i gray16_words_avx2(__m256i r, __m256i g, __m256i b)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(r, zero), _mm256_unpacklo_epi16(g, zero)),
+                                  _mm256_unpacklo_epi16(b, zero));
+    __m256i hi = _mm256_add_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(r, zero), _mm256_unpackhi_epi16(g, zero)),
+                                  _mm256_unpackhi_epi16(b, zero));
+
+    return _mm256_packus_epi32(div_epu32_avx2(lo, 3), div_epu32_avx2(hi, 3));
+}
+
+/*
+ * gray16_avx2 - Grayscale of 16 consecutive pixels. Pixels 0-7 go in the low
+ * lane and 8-15 in the high lane so the lane-local shuffles, unpacks and
+ * packs of the SSE version work unchanged.
+ */
+TARGET_AVX2 static inline __m256i gray16_avx2(const pixel* p)
+{
+    const __m128i* q = (const __m128i*)p;
+    __m256i v0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(q)), _mm_loadu_si128(q + 3), 1);
+    __m256i v1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(q + 1)), _mm_loadu_si128(q + 4), 1);
+    __m256i v2 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(q + 2)), _mm_loadu_si128(q + 5), 1);
+
+    __m256i r = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, LANES(RED_V0)),
+                                                _mm256_shuffle_epi8(v1, LANES(RED_V1))),
+                                _mm256_shuffle_epi8(v2, LANES(RED_V2)));
+    __m256i g = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, LANES(GREEN_V0)),
+                                                _mm256_shuffle_epi8(v1, LANES(GREEN_V1))),
+                                _mm256_shuffle_epi8(v2, LANES(GREEN_V2)));
+    __m256i b = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, LANES(BLUE_V0)),
+                                                _mm256_shuffle_epi8(v1, LANES(BLUE_V1))),
+                                _mm256_shuffle_epi8(v2, LANES(BLUE_V2)));
+
+    return gray16_words_avx2(r, g, b);
+}
+
+/*
+ * store_gray16_avx2 - Writes 16 gray words (lane-split as above) as 16 pixels.
+ */
+TARGET_AVX2 static inline void store_gray16_avx2(pixel* p, __m256i gray)
+{
+    __m256i* q = (__m256i*)p;
+    __m256i o0 = _mm256_shuffle_epi8(gray, LANES(GRAY_OUT0));
+    __m256i o1 = _mm256_shuffle_epi8(gray, LANES(GRAY_OUT1));
+    __m256i o2 = _mm256_shuffle_epi8(gray, LANES(GRAY_OUT2));
+
+    _mm256_storeu_si256(q, _mm256_permute2x128_si256(o0, o1, 0x20));
+    _mm256_storeu_si256(q + 1, _mm256_permute2x128_si256(o2, o0, 0x30));
+    _mm256_storeu_si256(q + 2, _mm256_permute2x128_si256(o1, o2, 0x31));
+}
+
+/*
+ * complex_tile16_avx2 - 16x16 tile. Each half of the rows is transposed lane by
+ * lane, then the 8x8 quadrants are swapped into place with permute2x128.
+ */
+TARGET_AVX2 static void complex_tile16_avx2(const pixel* s, int sstride, pixel* d, int dstride)
+{
+    __m256i r[16];
+    int k;
+
+    for (k = 0; k < 16; k++)
+        r[15 - k] = gray16_avx2(s + RIDX(k, 0, sstride));
+
+    TRANSPOSE8_EPI16(r, _mm256, __m256i);
+    TRANSPOSE8_EPI16((r + 8), _mm256, __m256i);
+
+    for (k = 0; k < 8; k++)
+    {
+        store_gray16_avx2(d + RIDX(15 - k, 0, dstride), _mm256_permute2x128_si256(r[k], r[k + 8], 0x20));
+        store_gray16_avx2(d + RIDX(7 - k, 0, dstride), _mm256_permute2x128_si256(r[k], r[k + 8], 0x31));
+    }
+}
+
+/*
+ * complex_avx2_region - 16x16 tiles, with the right and bottom strips that
+ * don't fill a 16-tile handled by the 8x8 SSE tile.
+ */
+static void complex_avx2_region(const pixel* s, int sstride, pixel* d, int dstride, int h, int w)
+{
+    int h16 = h & ~15, w16 = w & ~15;
+
+    complex_region(s, sstride, ROT_DEST(d, dstride, h, w, 0, 0, h16, w16), dstride,
+                   h16, w16, 16, complex_tile16_avx2);
+    if (w16 < w)
+        complex_region(s + w16, sstride, ROT_DEST(d, dstride, h, w, 0, w16, h, w - w16), dstride,
+                       h, w - w16, 8, complex_tile8_sse41);
+    if (h16 < h)
+        complex_region(s + RIDX(h16, 0, sstride), sstride, ROT_DEST(d, dstride, h, w, h16, 0, h - h16, w16), dstride,
+                       h - h16, w16, 8, complex_tile8_sse41);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+/* Instruction sets this CPU supports, filled in by kernels_init. */
+static int have_sse41 = 0;
+static int have_avx2 = 0;
+
+/*
+ * complex_select - Picks the widest region kernel the CPU supports.
+ */
+static complex_region_func complex_select(void)
+{
+#ifdef HAVE_X86_SIMD
+    if (have_avx2)
+        return complex_avx2_region;
+    if (have_sse41)
+        return complex_sse41_region;
+#endif
+    return complex_scalar_region;
+}
+
+static complex_region_func complex_impl = complex_scalar_region;
+
+/*
+ * kernels_init - Runs once at program startup to resolve the dispatched kernels.
+ */
+__attribute__((constructor)) static void kernels_init(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();  // cpuid
+    have_sse41 = __builtin_cpu_supports("sse4.1");
+    have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    complex_impl = complex_select();
+    load_kernel_profile(getenv("KERNELS_PROFILE") ? getenv("KERNELS_PROFILE") : "kernels.profile");
+}
+
+
+#define RECURSE_BASE 32  // Blocks this small go straight to the register-tiled kernel.
+
+/*
+ * complex_recursive_region - Cache-oblivious grayscale + rotate. Halves the
+ * longer side of the block until it is at most RECURSE_BASE x RECURSE_BASE,
+ * so at some depth the source and rotated blocks fit whichever cache level
+ * there is, with no tile size to tune. Splits land on multiples of 16 so the
+ * SIMD tiles stay whole; any dim works, the fringe goes to the scalar block.
+ */
+static void complex_recursive_region(const pixel* s, int sstride, pixel* d, int dstride, int h, int w)
+{
+    if (h <= RECURSE_BASE && w <= RECURSE_BASE)
+    {
+        complex_impl(s, sstride, d, dstride, h, w);
+    }
+    else if (h >= w)
+    {
+        int h1 = ((h / 2) + 15) & ~15;
+        if (h1 >= h)
+            h1 = h / 2;
+        complex_recursive_region(s, sstride, ROT_DEST(d, dstride, h, w, 0, 0, h1, w), dstride, h1, w);
+        complex_recursive_region(s + RIDX(h1, 0, sstride), sstride,
+                                 ROT_DEST(d, dstride, h, w, h1, 0, h - h1, w), dstride, h - h1, w);
+    }
+    else
+    {
+        int w1 = ((w / 2) + 15) & ~15;
+        if (w1 >= w)
+            w1 = w / 2;
+        complex_recursive_region(s, sstride, ROT_DEST(d, dstride, h, w, 0, 0, h, w1), dstride, h, w1);
+        complex_recursive_region(s + w1, sstride,
+                                 ROT_DEST(d, dstride, h, w, 0, w1, h, w - w1), dstride, h, w - w1);
+    }
+}
+
+
+/*
+ * complex_recursive - Recursive divide-and-conquer over the dispatched tile kernel
+ */
+char complex_recursive_descr[] = "complex_recursive: Cache-oblivious recursive rotate";
+void complex_recursive(int dim, pixel* src, pixel* dest)
+{
+    complex_recursive_region(src, dim, dest, dim, dim, dim);
+}
+
+
+/*
+ * complex_scalar - 8x8 tiled scalar version (what complex used to be)
+ */
+char complex_scalar_descr[] = "complex_scalar: 8x8 tiled scalar version";
+void complex_scalar(int dim, pixel* src, pixel* dest)
+{
+    complex_scalar_region(src, dim, dest, dim, dim, dim);
+}
+
+
+#ifdef HAVE_X86_SIMD
+/*
+ * complex_sse41 - 8x8 tiles, deinterleave + divide + transpose in SSE registers
+ */
+char complex_sse41_descr[] = "complex_sse41: 8x8 SSE4.1 tiles";
+void complex_sse41(int dim, pixel* src, pixel* dest)
+{
+    complex_sse41_region(src, dim, dest, dim, dim, dim);
+}
+
+
+/*
+ * complex_avx2 - 16x16 tiles in AVX2 registers, 8x8 SSE tiles on the fringe
+ */
+char complex_avx2_descr[] = "complex_avx2: 16x16 AVX2 tiles";
+void complex_avx2(int dim, pixel* src, pixel* dest)
+{
+    complex_avx2_region(src, dim, dest, dim, dim, dim);
+}
+#endif
+
+
+/* Arguments shared by every work item of a parallel kernel call. */
+typedef struct {
+    int dim;
+    pixel* src;
+    pixel* dst;
+    int block;      // complex: block edge, motion: band height
+    int nblocks;    // complex: blocks per block-row
+} par_job;
+
+/*
+ * complex_block_task - One block x block block of a parallel complex call.
+ */
+static void complex_block_task(void* argp, int item)
+{
+    par_job* job = argp;
+    int dim = job->dim, b = job->block;
+    int i = (item / job->nblocks) * b, j = (item % job->nblocks) * b;
+    int h = (dim - i < b) ? dim - i : b;
+    int w = (dim - j < b) ? dim - j : b;
+
+    complex_impl(job->src + RIDX(i, j, dim), dim, ROT_DEST(job->dst, dim, dim, dim, i, j, h, w), dim, h, w);
+}
+
+static void complex_parallel_n(int nthreads, int block, int dim, pixel* src, pixel* dest)
+{
+    par_job job = { dim, src, dest, block, (dim + block - 1) / block };
+    pool_run(complex_block_task, &job, job.nblocks * job.nblocks, nthreads);
+}
+
+
+/*
+ * complex_parallel - Blocks of the image spread over the thread pool,
+ * each block run through the dispatched tile kernel.
+ */
+char complex_parallel_descr[] = "complex_parallel: Thread pool over complex blocks";
+void complex_parallel(int dim, pixel* src, pixel* dest)
+{
+    complex_parallel_n(kernel_threads, complex_block_size, dim, src, dest);
+}
+
+/* Fixed thread counts, registered so the driver can chart the scaling curve. */
+#define COMPLEX_THREADS(n)                                                                 \
+char complex_par##n##_descr[] = "complex_par" #n ": Thread pool, " #n " threads";           \
+static void complex_par##n(int dim, pixel* src, pixel* dest) { complex_parallel_n(n, complex_block_size, dim, src, dest); }
+
+COMPLEX_THREADS(2)
+COMPLEX_THREADS(4)
+COMPLEX_THREADS(8)
+COMPLEX_THREADS(16)
+COMPLEX_THREADS(32)
+
+
+/*
+ * complex - Your current working version of complex
+ * IMPORTANT: This is the version you will be graded on
+ * Runs this host's autotuned winner for dim if a profile was loaded, else
+ * the best of the scalar/SSE4.1/AVX2 kernels picked at startup.
+ */
+char complex_descr[] = "complex: Current working version";
+void complex(int dim, pixel* src, pixel* dest)
+{
+    const profile_entry* tuned = profile_pick(KERNEL_COMPLEX, dim);
+
+    if (tuned)
+        tuned->variant->fn(dim, src, dest, tuned->threads, tuned->block);
+    else
+        complex_impl(src, dim, dest, dim, dim, dim);
+}
+
+/*********************************************************************
+ * register_complex_functions - Register all of your different versions
+ *     of the complex kernel with the driver by calling the
+ *     add_complex_function() for each test function. When you run the
+ *     driver program, it will test and report the performance of each
+ *     registered test function.
+ *********************************************************************/
+
+void register_complex_functions() {
+    add_complex_function(&complex, complex_descr);
+    add_complex_function(&naive_complex, naive_complex_descr);
+    add_complex_function(&complex_scalar, complex_scalar_descr);
+#ifdef HAVE_X86_SIMD
+    if (have_sse41)
+        add_complex_function(&complex_sse41, complex_sse41_descr);
+    if (have_avx2)
+        add_complex_function(&complex_avx2, complex_avx2_descr);
+#endif
+    add_complex_function(&complex_recursive, complex_recursive_descr);
+    add_complex_function(&complex_parallel, complex_parallel_descr);
+    add_complex_function(&complex_soa, complex_soa_descr);
+    add_complex_function(&complex_inplace_copy, complex_inplace_descr);
+    add_complex_function(&complex_fixed, complex_fixed_descr);
+    if (online_cpus() >= 2) add_complex_function(&complex_par2, complex_par2_descr);
+    if (online_cpus() >= 4) add_complex_function(&complex_par4, complex_par4_descr);
+    if (online_cpus() >= 8) add_complex_function(&complex_par8, complex_par8_descr);
+    if (online_cpus() >= 16) add_complex_function(&complex_par16, complex_par16_descr);
+    if (online_cpus() >= 32) add_complex_function(&complex_par32, complex_par32_descr);
+    //add_complex_function(&my_complex_v1, my_complex_v1_descr);
+    //add_complex_function(&my_complex_v2, my_complex_v2_descr);
+    //add_complex_function(&my_complex_v3, my_complex_v3_descr);
+}
+
+
+/***************
+ * MOTION KERNEL
+ **************/
+
+ /***************************************************************
+  * Various helper functions for the motion kernel
+  * You may modify these or add new ones any way you like.
+  **************************************************************/
+
+
+  /*
+   * weighted_combo - Returns new pixel value at (i,j)
+   */
+static pixel weighted_combo(int dim, int i, int j, pixel* src)
+{
+    int ii, jj;
+    pixel current_pixel;
+
+    int red, green, blue;
+    red = green = blue = 0;
+
+    int num_neighbors = 0;
+    for (ii = 0; ii < 3; ii++)
+        for (jj = 0; jj < 3; jj++)
+            if ((i + ii < dim) && (j + jj < dim))
+            {
+                num_neighbors++;
+                red += (int)src[RIDX(i + ii, j + jj, dim)].red;
+                green += (int)src[RIDX(i + ii, j + jj, dim)].green;
+                blue += (int)src[RIDX(i + ii, j + jj, dim)].blue;
+            }
+
+    current_pixel.red = (unsigned short)(red / num_neighbors);
+    current_pixel.green = (unsigned short)(green / num_neighbors);
+    current_pixel.blue = (unsigned short)(blue / num_neighbors);
+
+    return current_pixel;
+}
+
+
+/* Per-channel running sum of source pixels. */
+typedef struct {
+    unsigned int red, green, blue;
+} pixel_sum;
+
+/*
+ * motion_scratch - Per-thread column-sum buffer, grown on demand and reused
+ * across calls so the sliding engine never mallocs on the hot path.
+ * Returns NULL if it can't be grown to n.
+ */
+static pixel_sum* motion_scratch(int n)
+{
+    static __thread pixel_sum* buf = NULL;
+    static __thread int cap = 0;
+
+    if (n > cap)
+    {
+        free(buf);
+        buf = malloc(sizeof(pixel_sum) * n);
+        cap = buf ? n : 0;
+    }
+    return buf;
+}
+
+/* Divides a window sum into one output pixel. */
+#define MOTION_EMIT(d, win, div) do {                      \
+    (d).red = (unsigned short)div_small((win).red, div);     \
+    (d).green = (unsigned short)div_small((win).green, div); \
+    (d).blue = (unsigned short)div_small((win).blue, div);   \
+} while (0)
+
+/* Moves the window one column right: column j leaves, column j+3 enters. */
+#define MOTION_SLIDE(win, cs, j, ncols) do {           \
+    if ((j) + 3 < (ncols))                             \
+    {                                                  \
+        (win).red += (cs)[(j) + 3].red;                \
+        (win).green += (cs)[(j) + 3].green;            \
+        (win).blue += (cs)[(j) + 3].blue;              \
+    }                                                  \
+    (win).red -= (cs)[j].red;                          \
+    (win).green -= (cs)[j].green;                      \
+    (win).blue -= (cs)[j].blue;                        \
+} while (0)
+
+/*
+ * motion_row_out - Slides a 3-column window across one row of column sums.
+ * The window gains a column on the right and loses one on the left, so each
+ * output costs two adds and a subtract per channel. Outputs within two columns
+ * of the image's right edge see only 2 and then 1 columns.
+ */
+static inline void motion_row_out(const pixel_sum* cs, int ncols, pixel* dst, int w, int nr)
+{
+    pixel_sum win = { 0, 0, 0 };
+    int full = (ncols - 2 < w) ? ncols - 2 : w;
+    int j;
+
+    for (j = 0; j < 3 && j < ncols; j++)
+    {
+        win.red += cs[j].red;
+        win.green += cs[j].green;
+        win.blue += cs[j].blue;
+    }
+
+    if (nr == 3)
+    {
+        for (j = 0; j < full; j++)
+        {
+            MOTION_EMIT(dst[j], win, 9);
+            MOTION_SLIDE(win, cs, j, ncols);
+        }
+    }
+    else
+    {
+        for (j = 0; j < full; j++)
+        {
+            MOTION_EMIT(dst[j], win, nr * 3);
+            MOTION_SLIDE(win, cs, j, ncols);
+        }
+    }
+
+    for (j = (full > 0) ? full : 0; j < w; j++)
+    {
+        MOTION_EMIT(dst[j], win, nr * (ncols - j));
+        MOTION_SLIDE(win, cs, j, ncols);
+    }
+}
+
+/*
+ * motion_region_direct - motion_region without column sums, adding up each
+ * clipped window in full. Only used if the scratch buffer can't be had.
+ */
+static void motion_region_direct(const pixel* src, int sstride, pixel* dst, int dstride,
+                                 int w, int h, int avail_w, int avail_h)
+{
+    int i, j, a, b;
+
+    for (i = 0; i < h; i++)
+    {
+        int nr = (avail_h - i < 3) ? avail_h - i : 3;
+        for (j = 0; j < w; j++)
+        {
+            int nc = (avail_w - j < 3) ? avail_w - j : 3;
+            pixel_sum win = { 0, 0, 0 };
+
+            for (a = 0; a < nr; a++)
+                for (b = 0; b < nc; b++)
+                {
+                    const pixel* p = &src[RIDX(i + a, j + b, sstride)];
+                    win.red += p->red;
+                    win.green += p->green;
+                    win.blue += p->blue;
+                }
+            MOTION_EMIT(dst[RIDX(i, j, dstride)], win, nr * nc);
+        }
+    }
+}
+
+/*
+ * motion_region - Sliding-window motion blur of a w x h block of output.
+ * src and dst point at the block's top-left pixel; avail_w and avail_h count
+ * the columns and rows left in the image from there, which is what decides
+ * how far the 3x3 window is clipped (and so the 9/6/4/3/2/1 divisors).
+ * Keeps one 3-row sum per column and slides it down a row at a time.
+ */
+static void motion_region(const pixel* src, int sstride, pixel* dst, int dstride,
+                          int w, int h, int avail_w, int avail_h)
+{
+    int ncols = (w + 2 < avail_w) ? w + 2 : avail_w;
+    pixel_sum* cs;
+    int i, j, k;
+
+    if (w <= 0 || h <= 0)
+        return;
+
+    if ((cs = motion_scratch(ncols)) == NULL)
+    {
+        motion_region_direct(src, sstride, dst, dstride, w, h, avail_w, avail_h);
+        return;
+    }
+    for (j = 0; j < ncols; j++)
+    {
+        cs[j].red = cs[j].green = cs[j].blue = 0;
+        for (k = 0; k < 3 && k < avail_h; k++)
+        {
+            const pixel* p = &src[RIDX(k, j, sstride)];
+            cs[j].red += p->red;
+            cs[j].green += p->green;
+            cs[j].blue += p->blue;
+        }
+    }
+
+    for (i = 0; i < h; i++)
+    {
+        int nr = (avail_h - i < 3) ? avail_h - i : 3;
+
+        if (i > 0)
+        {
+            const pixel* out = &src[RIDX(i - 1, 0, sstride)];
+            const pixel* in = &src[RIDX(i + 2, 0, sstride)];
+            int entering = (i + 2 < avail_h);
+
+            for (j = 0; j < ncols; j++)
+            {
+                cs[j].red -= out[j].red;
+                cs[j].green -= out[j].green;
+                cs[j].blue -= out[j].blue;
+                if (entering)
+                {
+                    cs[j].red += in[j].red;
+                    cs[j].green += in[j].green;
+                    cs[j].blue += in[j].blue;
+                }
+            }
+        }
+
+        motion_row_out(cs, ncols, &dst[RIDX(i, 0, dstride)], w, nr);
+    }
+}
+
+
+
+/******************************************************
+ * Your different versions of the motion kernel go here
+ ******************************************************/
+
+ /*
+  * my_motion_v1 - Ver. 1 of optimizing blurring kernel.
+  * The if-statement in the nested for-loop is costly. Let's try and deal with
+  * the border pixels w/o any conditionals.
+  * ERROR ON EVERY PIXEL. TOOK AVERAGE BASED ON CENTER PIXEL. :(
+  */
+//char my_motion_v1_descr[] = "my_motion_v1: 1st attempt at optimizing motion";
+//void my_motion_v1(int dim, pixel* src, pixel* dst)
+//{
+//    pixel work;
+//    pixel* workPtr = &work;
+//
+//    int i = 0;
+//    int j = 0;         // Top-Left Pixel
+//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(0, 0, dim)].red
+//                                       + (unsigned int)src[RIDX(0, 1, dim)].red
+//                                       + (unsigned int)src[RIDX(1, 0, dim)].red
+//                                       + (unsigned int)src[RIDX(1, 1, dim)].red) / 4);
+//	workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(0, 0, dim)].green
+//								       + (unsigned int)src[RIDX(0, 1, dim)].green
+//									   + (unsigned int)src[RIDX(1, 0, dim)].green
+//									   + (unsigned int)src[RIDX(1, 1, dim)].green) / 4);
+//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(0, 0, dim)].blue
+//                                       + (unsigned int)src[RIDX(0, 1, dim)].blue
+//                                       + (unsigned int)src[RIDX(1, 0, dim)].blue
+//                                       + (unsigned int)src[RIDX(1, 1, dim)].blue) / 4);
+//    dst[RIDX(i, j, dim)] = work;
+//
+//    i = 0;
+//    j = dim - 1;       // Top-Right Pixel
+//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i  , j,   dim)].red
+//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].red
+//                                       + (unsigned int)src[RIDX(i  , j-1, dim)].red
+//                                       + (unsigned int)src[RIDX(i+1, j-1, dim)].red) / 4);
+//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].green
+//                                       + (unsigned int)src[RIDX(i,   j-1, dim)].green
+//                                       + (unsigned int)src[RIDX(i+1, j-1, dim)].green) / 4);
+//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+//                                       + (unsigned int)src[RIDX(i,   j-1, dim)].blue
 //                                       + (unsigned int)src[RIDX(i+1, j-1, dim)].blue) / 4);
 //    dst[RIDX(i, j, dim)] = work;
 //
@@ -428,385 +1471,2607 @@ static pixel weighted_combo(int dim, int i, int j, pixel* src)
 //}
 
 
- /*
-  * my_motion_v2 - Ver. 2 of optimizing blurring kernel.
-  * The if-statement in the nested for-loop is costly. Let's try and deal with
-  * the border pixels w/o any conditionals. (Using top-left pixel for 3x3 block.)
-  * 3.4 Speedup
-  */
-//char my_motion_v2_descr[] = "my_motion_v1: 2nd attempt at optimizing motion";
-//void my_motion_v2(int dim, pixel* src, pixel* dst)
-//{
-//    pixel work;
-//    pixel* workPtr = &work;
-//
-//    int i, j;
-//    for (i = 0; i < dim - 2; i++) // Full 3x3 Pixels
-//    {
-//        for (j = 0; j < dim - 2; j++)
-//        {
-//            workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-//                                               + (unsigned int)src[RIDX(i,   j+1, dim)].red
-//                                               + (unsigned int)src[RIDX(i,   j+2, dim)].red
-//                                               + (unsigned int)src[RIDX(i+1, j,   dim)].red
-//                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].red
-//                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].red
-//                                               + (unsigned int)src[RIDX(i+2, j,   dim)].red
-//                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].red
-//                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].red) / 9);
-//
-//            workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-//                                               + (unsigned int)src[RIDX(i,   j+1, dim)].green
-//                                               + (unsigned int)src[RIDX(i,   j+2, dim)].green
-//                                               + (unsigned int)src[RIDX(i+1, j,   dim)].green
-//                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].green
-//                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].green
-//                                               + (unsigned int)src[RIDX(i+2, j,   dim)].green
-//                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].green
-//                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].green) / 9);
-//
-//            workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-//                                               + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-//                                               + (unsigned int)src[RIDX(i,   j+2, dim)].blue
-//                                               + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-//                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
-//                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].blue
-//                                               + (unsigned int)src[RIDX(i+2, j,   dim)].blue
-//                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].blue
-//                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].blue) / 9);
-//
-//            dst[RIDX(i, j, dim)] = work;
-//        }
-//    }
-//
-//    i = dim - 2;
-//    for (j = 0; j < dim - 2; j++) // 2nd From Bottom Row
-//    {
-//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
-//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
-//                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].red) / 6);
-//
-//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
-//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
-//                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].green) / 6);
-//
-//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
-//                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].blue) / 6);
-//        dst[RIDX(i, j, dim)] = work;
-//    }
-//
-//    i = dim - 1;
-//    for (j = 0; j < dim - 2; j++) // Bottom Row
-//    {
-//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
-//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red) / 3);
-//
-//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
-//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green) / 3);
-//
-//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue) / 3);
-//        dst[RIDX(i, j, dim)] = work;
-//    }
-//
-//    j = dim - 2;
-//    for (i = 0; i < dim - 2; i++) // 2nd From Right Column
-//    {
-//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
-//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].red) / 6);
-//
-//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
-//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].green) / 6);
-//
-//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
-//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].blue) / 6);
-//        dst[RIDX(i, j, dim)] = work;
-//    }
-//
-//    j = dim - 1;
-//    for (i = 0; i < dim - 2; i++) // Right Column
-//    {
-//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
-//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red) / 3);
-//
-//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
-//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green) / 3);
-//
-//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue) / 3);
-//        dst[RIDX(i, j, dim)] = work;
-//    }
-//
-//    i = dim - 2;
-//    j = dim - 2;  // One Up & Left of Bottom-Right Pixel
-//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-//                                       + (unsigned int)src[RIDX(i,   j+1, dim)].red
-//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].red
-//                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].red) / 4);
-//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-//                                       + (unsigned int)src[RIDX(i,   j+1, dim)].green
-//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].green
-//                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].green) / 4);
-//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-//                                       + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-//                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].blue) / 4);
-//    dst[RIDX(i, j, dim)] = work;
-//
-//    i = dim - 2;
-//    j = dim - 1;  // One Above Bottom-Right Pixel
-//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].red
-//                                       + (unsigned int)src[RIDX(i+1, j, dim)].red) / 2);
-//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].green
-//                                       + (unsigned int)src[RIDX(i+1, j, dim)].green) / 2);
-//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].blue
-//                                       + (unsigned int)src[RIDX(i+1, j, dim)].blue) / 2);
-//    dst[RIDX(i, j, dim)] = work;
-//
-//    i = dim - 1;
-//    j = dim - 2;  // One Left of Bottom-Right Pixel
-//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].red
-//                                       + (unsigned int)src[RIDX(i, j+1, dim)].red) / 2);
-//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].green
-//                                       + (unsigned int)src[RIDX(i, j+1, dim)].green) / 2);
-//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].blue
-//                                       + (unsigned int)src[RIDX(i, j+1, dim)].blue) / 2);
-//    dst[RIDX(i, j, dim)] = work;
-//
-//    i = dim - 1;
-//    j = dim - 1;  // Bottom-Right Pixel
-//    dst[RIDX(i, j, dim)] = src[RIDX(i, j, dim)];
-//}
+ /*
+  * my_motion_v2 - Ver. 2 of optimizing blurring kernel.
+  * The if-statement in the nested for-loop is costly. Let's try and deal with
+  * the border pixels w/o any conditionals. (Using top-left pixel for 3x3 block.)
+  * 3.4 Speedup
+  */
+//char my_motion_v2_descr[] = "my_motion_v1: 2nd attempt at optimizing motion";
+//void my_motion_v2(int dim, pixel* src, pixel* dst)
+//{
+//    pixel work;
+//    pixel* workPtr = &work;
+//
+//    int i, j;
+//    for (i = 0; i < dim - 2; i++) // Full 3x3 Pixels
+//    {
+//        for (j = 0; j < dim - 2; j++)
+//        {
+//            workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+//                                               + (unsigned int)src[RIDX(i,   j+1, dim)].red
+//                                               + (unsigned int)src[RIDX(i,   j+2, dim)].red
+//                                               + (unsigned int)src[RIDX(i+1, j,   dim)].red
+//                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].red
+//                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].red
+//                                               + (unsigned int)src[RIDX(i+2, j,   dim)].red
+//                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].red
+//                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].red) / 9);
+//
+//            workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+//                                               + (unsigned int)src[RIDX(i,   j+1, dim)].green
+//                                               + (unsigned int)src[RIDX(i,   j+2, dim)].green
+//                                               + (unsigned int)src[RIDX(i+1, j,   dim)].green
+//                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].green
+//                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].green
+//                                               + (unsigned int)src[RIDX(i+2, j,   dim)].green
+//                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].green
+//                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].green) / 9);
+//
+//            workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+//                                               + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+//                                               + (unsigned int)src[RIDX(i,   j+2, dim)].blue
+//                                               + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+//                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
+//                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].blue
+//                                               + (unsigned int)src[RIDX(i+2, j,   dim)].blue
+//                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].blue
+//                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].blue) / 9);
+//
+//            dst[RIDX(i, j, dim)] = work;
+//        }
+//    }
+//
+//    i = dim - 2;
+//    for (j = 0; j < dim - 2; j++) // 2nd From Bottom Row
+//    {
+//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
+//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
+//                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].red) / 6);
+//
+//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
+//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
+//                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].green) / 6);
+//
+//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
+//                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].blue) / 6);
+//        dst[RIDX(i, j, dim)] = work;
+//    }
+//
+//    i = dim - 1;
+//    for (j = 0; j < dim - 2; j++) // Bottom Row
+//    {
+//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
+//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red) / 3);
+//
+//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
+//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green) / 3);
+//
+//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+//                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue) / 3);
+//        dst[RIDX(i, j, dim)] = work;
+//    }
+//
+//    j = dim - 2;
+//    for (i = 0; i < dim - 2; i++) // 2nd From Right Column
+//    {
+//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
+//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].red) / 6);
+//
+//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
+//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].green) / 6);
+//
+//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
+//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].blue) / 6);
+//        dst[RIDX(i, j, dim)] = work;
+//    }
+//
+//    j = dim - 1;
+//    for (i = 0; i < dim - 2; i++) // Right Column
+//    {
+//        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
+//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red) / 3);
+//
+//        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
+//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green) / 3);
+//
+//        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+//                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue) / 3);
+//        dst[RIDX(i, j, dim)] = work;
+//    }
+//
+//    i = dim - 2;
+//    j = dim - 2;  // One Up & Left of Bottom-Right Pixel
+//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+//                                       + (unsigned int)src[RIDX(i,   j+1, dim)].red
+//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].red
+//                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].red) / 4);
+//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+//                                       + (unsigned int)src[RIDX(i,   j+1, dim)].green
+//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].green
+//                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].green) / 4);
+//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+//                                       + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+//                                       + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+//                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].blue) / 4);
+//    dst[RIDX(i, j, dim)] = work;
+//
+//    i = dim - 2;
+//    j = dim - 1;  // One Above Bottom-Right Pixel
+//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].red
+//                                       + (unsigned int)src[RIDX(i+1, j, dim)].red) / 2);
+//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].green
+//                                       + (unsigned int)src[RIDX(i+1, j, dim)].green) / 2);
+//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].blue
+//                                       + (unsigned int)src[RIDX(i+1, j, dim)].blue) / 2);
+//    dst[RIDX(i, j, dim)] = work;
+//
+//    i = dim - 1;
+//    j = dim - 2;  // One Left of Bottom-Right Pixel
+//    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].red
+//                                       + (unsigned int)src[RIDX(i, j+1, dim)].red) / 2);
+//    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].green
+//                                       + (unsigned int)src[RIDX(i, j+1, dim)].green) / 2);
+//    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].blue
+//                                       + (unsigned int)src[RIDX(i, j+1, dim)].blue) / 2);
+//    dst[RIDX(i, j, dim)] = work;
+//
+//    i = dim - 1;
+//    j = dim - 1;  // Bottom-Right Pixel
+//    dst[RIDX(i, j, dim)] = src[RIDX(i, j, dim)];
+//}
+
+ /*
+  * naive_motion - The naive baseline version of motion
+  */
+char naive_motion_descr[] = "naive_motion: Naive baseline implementation";
+void naive_motion(int dim, pixel* src, pixel* dst)
+{
+    int i, j;
+
+    for (i = 0; i < dim; i++)
+        for (j = 0; j < dim; j++)
+            dst[RIDX(i, j, dim)] = weighted_combo(dim, i, j, src);
+}
+
+
+/*
+ * motion_sliding - Running column sums slid across the image. Bit-exact
+ * with naive_motion, including the clipped borders, for any dim.
+ */
+char motion_sliding_descr[] = "motion_sliding: Sliding-window column sums";
+void motion_sliding(int dim, pixel* src, pixel* dst)
+{
+    motion_region(src, dim, dst, dim, dim, dim, dim, dim);
+}
+
+
+/*
+ * motion_band_task - One band of rows of a parallel motion call.
+ */
+static void motion_band_task(void* argp, int item)
+{
+    par_job* job = argp;
+    int dim = job->dim, i = item * job->block;
+    int h = (dim - i < job->block) ? dim - i : job->block;
+
+    motion_region(job->src + RIDX(i, 0, dim), dim, job->dst + RIDX(i, 0, dim), dim, dim, h, dim, dim - i);
+}
+
+static void motion_parallel_n(int nthreads, int band, int dim, pixel* src, pixel* dst)
+{
+    par_job job = { dim, src, dst, band, 0 };
+    pool_run(motion_band_task, &job, (dim + band - 1) / band, nthreads);
+}
+
+
+/*
+ * motion_parallel - Row bands of the sliding engine spread over the thread pool
+ */
+char motion_parallel_descr[] = "motion_parallel: Thread pool over row bands";
+void motion_parallel(int dim, pixel* src, pixel* dst)
+{
+    motion_parallel_n(kernel_threads, motion_band_rows, dim, src, dst);
+}
+
+#define MOTION_THREADS(n)                                                                  \
+char motion_par##n##_descr[] = "motion_par" #n ": Thread pool, " #n " threads";             \
+static void motion_par##n(int dim, pixel* src, pixel* dst) { motion_parallel_n(n, motion_band_rows, dim, src, dst); }
+
+MOTION_THREADS(2)
+MOTION_THREADS(4)
+MOTION_THREADS(8)
+MOTION_THREADS(16)
+MOTION_THREADS(32)
+
+
+/*
+ * motion_unrolled - Hand-unrolled 3x3 interior plus the eight border cases.
+ * motion's default when there is no autotuned profile for dim.
+ */
+static void motion_unrolled(int dim, pixel* src, pixel* dst)
+{
+    pixel work;
+    pixel* workPtr = &work;
+
+    int i, j;
+    for (i = 0; i < dim - 2; i++) // Full 3x3 Pixels
+    {
+        for (j = 0; j < dim - 2; j++)
+        {
+            workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+                                               + (unsigned int)src[RIDX(i,   j+1, dim)].red
+                                               + (unsigned int)src[RIDX(i,   j+2, dim)].red
+                                               + (unsigned int)src[RIDX(i+1, j,   dim)].red
+                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].red
+                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].red
+                                               + (unsigned int)src[RIDX(i+2, j,   dim)].red
+                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].red
+                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].red) / 9);
+
+            workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+                                               + (unsigned int)src[RIDX(i,   j+1, dim)].green
+                                               + (unsigned int)src[RIDX(i,   j+2, dim)].green
+                                               + (unsigned int)src[RIDX(i+1, j,   dim)].green
+                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].green
+                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].green
+                                               + (unsigned int)src[RIDX(i+2, j,   dim)].green
+                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].green
+                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].green) / 9);
+
+            workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+                                               + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+                                               + (unsigned int)src[RIDX(i,   j+2, dim)].blue
+                                               + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
+                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].blue
+                                               + (unsigned int)src[RIDX(i+2, j,   dim)].blue
+                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].blue
+                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].blue) / 9);
+
+            dst[RIDX(i, j, dim)] = work;
+        }
+    }
+
+    i = dim - 2;
+    for (j = 0; j < dim - 2; j++) // 2nd From Bottom Row
+    {
+        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
+                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
+                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
+                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].red) / 6);
+
+        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
+                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
+                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
+                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].green) / 6);
+
+        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
+                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].blue) / 6);
+        dst[RIDX(i, j, dim)] = work;
+    }
+
+    i = dim - 1;
+    for (j = 0; j < dim - 2; j++) // Bottom Row
+    {
+        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
+                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red) / 3);
+
+        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
+                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green) / 3);
+
+        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue) / 3);
+        dst[RIDX(i, j, dim)] = work;
+    }
+
+    j = dim - 2;
+    for (i = 0; i < dim - 2; i++) // 2nd From Right Column
+    {
+        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
+                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
+                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red
+                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].red) / 6);
+
+        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
+                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
+                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green
+                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].green) / 6);
+
+        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
+                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].blue) / 6);
+        dst[RIDX(i, j, dim)] = work;
+    }
+
+    j = dim - 1;
+    for (i = 0; i < dim - 2; i++) // Right Column
+    {
+        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
+                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red) / 3);
+
+        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
+                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green) / 3);
+
+        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue) / 3);
+        dst[RIDX(i, j, dim)] = work;
+    }
+
+    i = dim - 2;
+    j = dim - 2;  // One Up & Left of Bottom-Right Pixel
+    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
+                                       + (unsigned int)src[RIDX(i,   j+1, dim)].red
+                                       + (unsigned int)src[RIDX(i+1, j,   dim)].red
+                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].red) / 4);
+    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
+                                       + (unsigned int)src[RIDX(i,   j+1, dim)].green
+                                       + (unsigned int)src[RIDX(i+1, j,   dim)].green
+                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].green) / 4);
+    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
+                                       + (unsigned int)src[RIDX(i,   j+1, dim)].blue
+                                       + (unsigned int)src[RIDX(i+1, j,   dim)].blue
+                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].blue) / 4);
+    dst[RIDX(i, j, dim)] = work;
+
+    i = dim - 2;
+    j = dim - 1;  // One Above Bottom-Right Pixel
+    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].red
+                                       + (unsigned int)src[RIDX(i+1, j, dim)].red) / 2);
+    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].green
+                                       + (unsigned int)src[RIDX(i+1, j, dim)].green) / 2);
+    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].blue
+                                       + (unsigned int)src[RIDX(i+1, j, dim)].blue) / 2);
+    dst[RIDX(i, j, dim)] = work;
+
+    i = dim - 1;
+    j = dim - 2;  // One Left of Bottom-Right Pixel
+    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].red
+                                       + (unsigned int)src[RIDX(i, j+1, dim)].red) / 2);
+    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].green
+                                       + (unsigned int)src[RIDX(i, j+1, dim)].green) / 2);
+    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].blue
+                                       + (unsigned int)src[RIDX(i, j+1, dim)].blue) / 2);
+    dst[RIDX(i, j, dim)] = work;
+
+    i = dim - 1;
+    j = dim - 1;  // Bottom-Right Pixel
+    dst[RIDX(i, j, dim)] = src[RIDX(i, j, dim)];
+}
+
+
+/*
+ * motion - Your current working version of motion.
+ * IMPORTANT: This is the version you will be graded on
+ * Runs this host's autotuned winner for dim if a profile was loaded.
+ */
+char motion_descr[] = "motion: Current working version";
+void motion(int dim, pixel* src, pixel* dst)
+{
+    const profile_entry* tuned = profile_pick(KERNEL_MOTION, dim);
+
+    if (tuned)
+        tuned->variant->fn(dim, src, dst, tuned->threads, tuned->block);
+    else
+        motion_unrolled(dim, src, dst);
+}
+
+/*********************************************************************
+ * register_motion_functions - Register all of your different versions
+ *     of the motion kernel with the driver by calling the
+ *     add_motion_function() for each test function.  When you run the
+ *     driver program, it will test and report the performance of each
+ *     registered test function.
+ *********************************************************************/
+
+void register_motion_functions() {
+    add_motion_function(&motion, motion_descr);
+    add_motion_function(&naive_motion, naive_motion_descr);
+    add_motion_function(&motion_sliding, motion_sliding_descr);
+    add_motion_function(&motion_parallel, motion_parallel_descr);
+    add_motion_function(&motion_soa, motion_soa_descr);
+    add_motion_function(&motion_conv3, motion_conv3_descr);
+    add_motion_function(&motion_ghosted, motion_ghosted_descr);
+    add_motion_function(&motion_fixed, motion_fixed_descr);
+    if (online_cpus() >= 2) add_motion_function(&motion_par2, motion_par2_descr);
+    if (online_cpus() >= 4) add_motion_function(&motion_par4, motion_par4_descr);
+    if (online_cpus() >= 8) add_motion_function(&motion_par8, motion_par8_descr);
+    if (online_cpus() >= 16) add_motion_function(&motion_par16, motion_par16_descr);
+    if (online_cpus() >= 32) add_motion_function(&motion_par32, motion_par32_descr);
+    //add_motion_function(&my_motion_v1, my_motion_v1_descr);
+    //add_motion_function(&my_motion_v2, my_motion_v2_descr);
+}
+
+
+/************************
+ * FUSED COMPLEX -> MOTION
+ ************************/
+
+#define FUSED_BAND 32  // Rows of complex output blurred per pass.
+
+/*
+ * complex_motion - motion(complex(src)) without the dim x dim intermediate.
+ * complex output is produced FUSED_BAND rows at a time into a window of
+ * FUSED_BAND + 2 rows, blurred while it is still in cache, and the last two
+ * rows are carried over as the halo of the next band.
+ *
+ * Rows [a, a+n) of complex's output are the rotated image of src columns
+ * [dim-a-n, dim-a), so each band is one complex region call.
+ */
+void complex_motion(int dim, pixel* src, pixel* dst)
+{
+    pixel* ring = malloc(sizeof(pixel) * (FUSED_BAND + 2) * dim);
+    int r0;
+
+    if (!ring)
+    {
+        // Output (i, j) only reads rows >= i and columns >= j, so the blur
+        // can run in place over dst in raster order
+        complex_impl(src, dim, dst, dim, dim, dim);
+        motion_region_direct(dst, dim, dst, dim, dim, dim, dim, dim);
+        return;
+    }
+    for (r0 = 0; r0 < dim; r0 += FUSED_BAND)
+    {
+        int h = (dim - r0 < FUSED_BAND) ? dim - r0 : FUSED_BAND;
+        int end = (r0 + h + 2 < dim) ? r0 + h + 2 : dim;  // One past the last row the band reads
+        int have = 0;
+
+        if (r0 > 0)
+        {
+            have = (dim - r0 < 2) ? dim - r0 : 2;
+            memmove(ring, ring + RIDX(FUSED_BAND, 0, dim), sizeof(pixel) * have * dim);
+        }
+
+        if (r0 + have < end)
+            complex_impl(src + (dim - end), dim, ring + RIDX(have, 0, dim), dim, dim, end - r0 - have);
+
+        motion_region(ring, dim, dst + RIDX(r0, 0, dim), dim, dim, h, dim, dim - r0);
+    }
+
+    free(ring);
+}
+
+
+/************************
+ * PLANAR (SoA) IMAGES
+ ************************/
+
+#define PLANE_ALIGN 64  // Planes start on a cache line (and any vector width).
+
+/*
+ * planar_alloc - One allocation holding three aligned dim x dim planes.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int planar_alloc(planar_image* img, int dim)
+{
+    size_t plane = ((size_t)dim * dim * sizeof(unsigned short) + PLANE_ALIGN - 1) & ~(size_t)(PLANE_ALIGN - 1);
+    void* mem;
+
+    if (posix_memalign(&mem, PLANE_ALIGN, 3 * plane + PLANE_ALIGN) != 0)
+        return -1;
+
+    img->dim = dim;
+    img->red = mem;
+    img->green = (unsigned short*)((char*)mem + plane);
+    img->blue = (unsigned short*)((char*)mem + 2 * plane);
+    return 0;
+}
+
+void planar_free(planar_image* img)
+{
+    free(img->red);
+    img->red = img->green = img->blue = NULL;
+}
+
+
+#ifdef HAVE_X86_SIMD
+/* Word shuffles re-interleaving 8 red/green/blue words into the v0, v1, v2 layout above. */
+#define V0_RED   WSHUF( 0, -1, -1,  1, -1, -1,  2, -1)
+#define V0_GREEN WSHUF(-1,  0, -1, -1,  1, -1, -1,  2)
+#define V0_BLUE  WSHUF(-1, -1,  0, -1, -1,  1, -1, -1)
+#define V1_RED   WSHUF(-1,  3, -1, -1,  4, -1, -1,  5)
+#define V1_GREEN WSHUF(-1, -1,  3, -1, -1,  4, -1, -1)
+#define V1_BLUE  WSHUF( 2, -1, -1,  3, -1, -1,  4, -1)
+#define V2_RED   WSHUF(-1, -1,  6, -1, -1,  7, -1, -1)
+#define V2_GREEN WSHUF( 5, -1, -1,  6, -1, -1,  7, -1)
+#define V2_BLUE  WSHUF(-1,  5, -1, -1,  6, -1, -1,  7)
+
+TARGET_SSE41 static void pixel_to_planar_sse41(const pixel* src, unsigned short* r, unsigned short* g,
+                                               unsigned short* b, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k + 8 <= n; k += 8)
+    {
+        __m128i vr, vg, vb;
+        deinterleave8_sse41(src + k, &vr, &vg, &vb);
+        _mm_storeu_si128((__m128i*)(r + k), vr);
+        _mm_storeu_si128((__m128i*)(g + k), vg);
+        _mm_storeu_si128((__m128i*)(b + k), vb);
+    }
+    for (; k < n; k++)
+    {
+        r[k] = src[k].red;
+        g[k] = src[k].green;
+        b[k] = src[k].blue;
+    }
+}
+
+TARGET_SSE41 static void planar_to_pixel_sse41(const unsigned short* r, const unsigned short* g,
+                                               const unsigned short* b, pixel* dst, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k + 8 <= n; k += 8)
+    {
+        __m128i vr = _mm_loadu_si128((const __m128i*)(r + k));
+        __m128i vg = _mm_loadu_si128((const __m128i*)(g + k));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + k));
+        __m128i* q = (__m128i*)(dst + k);
+
+        _mm_storeu_si128(q, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, V0_RED), _mm_shuffle_epi8(vg, V0_GREEN)),
+                                         _mm_shuffle_epi8(vb, V0_BLUE)));
+        _mm_storeu_si128(q + 1, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, V1_RED), _mm_shuffle_epi8(vg, V1_GREEN)),
+                                             _mm_shuffle_epi8(vb, V1_BLUE)));
+        _mm_storeu_si128(q + 2, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, V2_RED), _mm_shuffle_epi8(vg, V2_GREEN)),
+                                             _mm_shuffle_epi8(vb, V2_BLUE)));
+    }
+    for (; k < n; k++)
+    {
+        dst[k].red = r[k];
+        dst[k].green = g[k];
+        dst[k].blue = b[k];
+    }
+}
+#endif
+
+
+/*
+ * pixel_to_planar - Splits an interleaved image straight into dst's planes,
+ * one pass and no intermediate buffer. dst must be allocated for dim.
+ */
+void pixel_to_planar(int dim, const pixel* src, planar_image* dst)
+{
+    size_t n = (size_t)dim * dim, k;
+
+#ifdef HAVE_X86_SIMD
+    if (have_sse41)
+    {
+        pixel_to_planar_sse41(src, dst->red, dst->green, dst->blue, n);
+        return;
+    }
+#endif
+    for (k = 0; k < n; k++)
+    {
+        dst->red[k] = src[k].red;
+        dst->green[k] = src[k].green;
+        dst->blue[k] = src[k].blue;
+    }
+}
+
+/*
+ * planar_to_pixel - Interleaves src's planes straight into dst.
+ */
+void planar_to_pixel(const planar_image* src, pixel* dst)
+{
+    size_t n = (size_t)src->dim * src->dim, k;
+
+#ifdef HAVE_X86_SIMD
+    if (have_sse41)
+    {
+        planar_to_pixel_sse41(src->red, src->green, src->blue, dst, n);
+        return;
+    }
+#endif
+    for (k = 0; k < n; k++)
+    {
+        dst[k].red = src->red[k];
+        dst[k].green = src->green[k];
+        dst[k].blue = src->blue[k];
+    }
+}
+
+
+/*
+ * planar_block - Scalar grayscale + rotate of an h x w block of planes, same
+ * block conventions as complex_block (so, offsets so and do into the planes).
+ */
+static void planar_block(const planar_image* s, size_t so, planar_image* d, size_t dof, int h, int w)
+{
+    int dim = s->dim, r, c;
+
+    for (r = 0; r < h; r++)
+        for (c = 0; c < w; c++)
+        {
+            size_t in = so + RIDX(r, c, dim), out = dof + RIDX(w - 1 - c, h - 1 - r, dim);
+            unsigned short val = (unsigned short)div_small((unsigned int)s->red[in] + s->green[in] + s->blue[in], 3);
+            d->red[out] = val;
+            d->green[out] = val;
+            d->blue[out] = val;
+        }
+}
+
+typedef void (*planar_tile_func)(const planar_image*, size_t, planar_image*, size_t);
+
+#ifdef HAVE_X86_SIMD
+/*
+ * planar_tile8_sse41 - 8x8 tile. The channels load straight into registers,
+ * so all that's left of the interleaved version is the sum and transpose.
+ */
+TARGET_SSE41 static void planar_tile8_sse41(const planar_image* s, size_t so, planar_image* d, size_t dof)
+{
+    int dim = s->dim, k;
+    __m128i r[8];
+
+    for (k = 0; k < 8; k++)
+    {
+        size_t in = so + RIDX(k, 0, dim);
+        r[7 - k] = gray8_words_sse41(_mm_loadu_si128((const __m128i*)(s->red + in)),
+                                     _mm_loadu_si128((const __m128i*)(s->green + in)),
+                                     _mm_loadu_si128((const __m128i*)(s->blue + in)));
+    }
+
+    TRANSPOSE8_EPI16(r, _mm, __m128i);
+
+    for (k = 0; k < 8; k++)
+    {
+        size_t out = dof + RIDX(7 - k, 0, dim);
+        _mm_storeu_si128((__m128i*)(d->red + out), r[k]);
+        _mm_storeu_si128((__m128i*)(d->green + out), r[k]);
+        _mm_storeu_si128((__m128i*)(d->blue + out), r[k]);
+    }
+}
+
+/*
+ * planar_tile16_avx2 - 16x16 tile, transposed the same way as complex_tile16_avx2.
+ */
+TARGET_AVX2 static void planar_tile16_avx2(const planar_image* s, size_t so, planar_image* d, size_t dof)
+{
+    int dim = s->dim, k;
+    __m256i r[16];
+
+    for (k = 0; k < 16; k++)
+    {
+        size_t in = so + RIDX(k, 0, dim);
+        r[15 - k] = gray16_words_avx2(_mm256_loadu_si256((const __m256i*)(s->red + in)),
+                                      _mm256_loadu_si256((const __m256i*)(s->green + in)),
+                                      _mm256_loadu_si256((const __m256i*)(s->blue + in)));
+    }
+
+    TRANSPOSE8_EPI16(r, _mm256, __m256i);
+    TRANSPOSE8_EPI16((r + 8), _mm256, __m256i);
+
+    for (k = 0; k < 8; k++)
+    {
+        __m256i top = _mm256_permute2x128_si256(r[k], r[k + 8], 0x20);
+        __m256i bottom = _mm256_permute2x128_si256(r[k], r[k + 8], 0x31);
+        size_t out = dof + RIDX(15 - k, 0, dim);
+
+        _mm256_storeu_si256((__m256i*)(d->red + out), top);
+        _mm256_storeu_si256((__m256i*)(d->green + out), top);
+        _mm256_storeu_si256((__m256i*)(d->blue + out), top);
+        out = dof + RIDX(7 - k, 0, dim);
+        _mm256_storeu_si256((__m256i*)(d->red + out), bottom);
+        _mm256_storeu_si256((__m256i*)(d->green + out), bottom);
+        _mm256_storeu_si256((__m256i*)(d->blue + out), bottom);
+    }
+}
+#endif
+
+/*
+ * complex_planar - Grayscale + anti-diagonal rotate of a planar image.
+ * dst must be allocated for the same dim; all three of its planes get the gray.
+ */
+void complex_planar(const planar_image* src, planar_image* dst)
+{
+    int dim = src->dim, tile = TILE, i, j;
+    planar_tile_func tile_fn = NULL;
+
+#ifdef HAVE_X86_SIMD
+    if (have_avx2)
+    {
+        tile = 16;
+        tile_fn = planar_tile16_avx2;
+    }
+    else if (have_sse41)
+        tile_fn = planar_tile8_sse41;
+#endif
+
+    for (i = 0; i < dim; i += tile)
+    {
+        int th = (dim - i < tile) ? dim - i : tile;
+        for (j = 0; j < dim; j += tile)
+        {
+            int tw = (dim - j < tile) ? dim - j : tile;
+            size_t so = RIDX(i, j, dim), dof = RIDX(dim - j - tw, dim - i - th, dim);
+
+            if (tile_fn && th == tile && tw == tile)
+                tile_fn(src, so, dst, dof);
+            else
+                planar_block(src, so, dst, dof, th, tw);
+        }
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+/*
+ * motion_hsum_sse41 - out[j] = (v[j] + v[j+1] + v[j+2]) / d, 8 columns at
+ * a time through the reciprocal divide. Returns how many columns it did.
+ */
+TARGET_SSE41 static int motion_hsum_sse41(const unsigned int* v, unsigned short* out, int n, unsigned int d)
+{
+    int j;
+
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)(v + j)),
+                                                 _mm_loadu_si128((const __m128i*)(v + j + 1))),
+                                   _mm_loadu_si128((const __m128i*)(v + j + 2)));
+        __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)(v + j + 4)),
+                                                 _mm_loadu_si128((const __m128i*)(v + j + 5))),
+                                   _mm_loadu_si128((const __m128i*)(v + j + 6)));
+        _mm_storeu_si128((__m128i*)(out + j), _mm_packus_epi32(div_epu32_sse41(lo, d), div_epu32_sse41(hi, d)));
+    }
+    return j;
+}
+
+/*
+ * motion_hsum_avx2 - motion_hsum_sse41, 16 columns at a time.
+ */
+TARGET_AVX2 static int motion_hsum_avx2(const unsigned int* v, unsigned short* out, int n, unsigned int d)
+{
+    int j;
+
+    for (j = 0; j + 16 <= n; j += 16)
+    {
+        __m256i lo = _mm256_add_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(v + j)),
+                                                       _mm256_loadu_si256((const __m256i*)(v + j + 1))),
+                                      _mm256_loadu_si256((const __m256i*)(v + j + 2)));
+        __m256i hi = _mm256_add_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(v + j + 8)),
+                                                       _mm256_loadu_si256((const __m256i*)(v + j + 9))),
+                                      _mm256_loadu_si256((const __m256i*)(v + j + 10)));
+        __m256i packed = _mm256_packus_epi32(div_epu32_avx2(lo, d), div_epu32_avx2(hi, d));
+        // packus works per 128-bit lane; put the four quarters back in order
+        _mm256_storeu_si256((__m256i*)(out + j), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    return j;
+}
+#endif
+
+/*
+ * motion_hsum - Vector part of motion_plane's horizontal pass; the caller
+ * finishes the columns it returns short of n.
+ */
+static int motion_hsum(const unsigned int* v, unsigned short* out, int n, unsigned int d)
+{
+#ifdef HAVE_X86_SIMD
+    if (have_avx2)
+        return motion_hsum_avx2(v, out, n, d);
+    if (have_sse41)
+        return motion_hsum_sse41(v, out, n, d);
+#endif
+    return 0;
+}
+
+/*
+ * motion_plane - Box blur of one plane, separable: a vertical 3-row sum into
+ * a row buffer, then a horizontal 3-column sum. Both loops are unit stride
+ * over a single channel; the vertical one is left to the compiler and the
+ * horizontal one, which divides, to motion_hsum.
+ */
+static void motion_plane(int dim, const unsigned short* src, unsigned short* dst, unsigned int* vsum)
+{
+    int i, j;
+
+    for (i = 0; i < dim; i++)
+    {
+        const unsigned short* p0 = src + RIDX(i, 0, dim);
+        unsigned short* out = dst + RIDX(i, 0, dim);
+        int nr = (dim - i < 3) ? dim - i : 3;
+
+        if (nr == 3)
+        {
+            const unsigned short* p1 = p0 + dim;
+            const unsigned short* p2 = p1 + dim;
+            for (j = 0; j < dim; j++)
+                vsum[j] = (unsigned int)p0[j] + p1[j] + p2[j];
+        }
+        else
+        {
+            for (j = 0; j < dim; j++)
+                vsum[j] = (nr == 2) ? (unsigned int)p0[j] + p0[j + dim] : p0[j];
+        }
+
+        for (j = motion_hsum(vsum, out, dim - 2, nr * 3); j < dim - 2; j++)
+            out[j] = (unsigned short)div_small(vsum[j] + vsum[j + 1] + vsum[j + 2], nr * 3);
+
+        if (dim >= 2)
+            out[dim - 2] = (unsigned short)div_small(vsum[dim - 2] + vsum[dim - 1], nr * 2);
+        out[dim - 1] = (unsigned short)div_small(vsum[dim - 1], nr);
+    }
+}
+
+/*
+ * motion_plane_direct - motion_plane without the row buffer, summing each
+ * clipped window in full. Only used if the buffer can't be allocated.
+ */
+static void motion_plane_direct(int dim, const unsigned short* src, unsigned short* dst)
+{
+    int i, j, a, b;
+
+    for (i = 0; i < dim; i++)
+    {
+        int nr = (dim - i < 3) ? dim - i : 3;
+        for (j = 0; j < dim; j++)
+        {
+            int nc = (dim - j < 3) ? dim - j : 3;
+            unsigned int sum = 0;
+
+            for (a = 0; a < nr; a++)
+                for (b = 0; b < nc; b++)
+                    sum += src[RIDX(i + a, j + b, dim)];
+            dst[RIDX(i, j, dim)] = (unsigned short)(sum / (nr * nc));
+        }
+    }
+}
+
+/*
+ * motion_planar - motion blur of a planar image, one plane at a time.
+ */
+void motion_planar(const planar_image* src, planar_image* dst)
+{
+    int dim = src->dim;
+    unsigned int* vsum = malloc(sizeof(unsigned int) * dim);
+
+    if (!vsum)
+    {
+        motion_plane_direct(dim, src->red, dst->red);
+        motion_plane_direct(dim, src->green, dst->green);
+        motion_plane_direct(dim, src->blue, dst->blue);
+        return;
+    }
+    motion_plane(dim, src->red, dst->red, vsum);
+    motion_plane(dim, src->green, dst->green, vsum);
+    motion_plane(dim, src->blue, dst->blue, vsum);
+    free(vsum);
+}
+
+
+/*
+ * planar_scratch - Per-thread planar images reused by the driver wrappers
+ * below, or NULL if they can't be allocated.
+ */
+static planar_image* planar_scratch(int dim)
+{
+    static __thread planar_image img[2];
+
+    if (img[0].dim != dim || !img[0].red)
+    {
+        planar_free(&img[0]);
+        planar_free(&img[1]);
+        img[0].dim = 0;
+        if (planar_alloc(&img[0], dim) || planar_alloc(&img[1], dim))
+        {
+            planar_free(&img[0]);
+            img[0].dim = 0;
+            return NULL;
+        }
+    }
+    return img;
+}
+
+/*
+ * complex_soa / motion_soa - AoS in, AoS out through the planar kernels.
+ * The timing includes both conversions, so the driver shows what a caller
+ * with interleaved data would see; callers that keep their frames planar
+ * skip the conversions and only pay for complex_planar/motion_planar.
+ * Without scratch memory they run the AoS kernels directly, not through
+ * complex()/motion(), which a profile may point right back here.
+ */
+char complex_soa_descr[] = "complex_soa: Planar kernel, incl. AoS<->SoA conversion";
+void complex_soa(int dim, pixel* src, pixel* dest)
+{
+    planar_image* img = planar_scratch(dim);
+
+    if (!img)
+    {
+        complex_impl(src, dim, dest, dim, dim, dim);
+        return;
+    }
+    pixel_to_planar(dim, src, &img[0]);
+    complex_planar(&img[0], &img[1]);
+    planar_to_pixel(&img[1], dest);
+}
+
+char motion_soa_descr[] = "motion_soa: Planar kernel, incl. AoS<->SoA conversion";
+void motion_soa(int dim, pixel* src, pixel* dst)
+{
+    planar_image* img = planar_scratch(dim);
+
+    if (!img)
+    {
+        motion_unrolled(dim, src, dst);
+        return;
+    }
+    pixel_to_planar(dim, src, &img[0]);
+    motion_planar(&img[0], &img[1]);
+    planar_to_pixel(&img[1], dst);
+}
+
+
+/************************
+ * FIXED-SIZE KERNELS
+ ************************/
+
+/*
+ * Copies of complex and motion for the frame sizes we actually see, with
+ * dim a compile-time constant: every stride and trip count is known and no
+ * edge or fringe code is left. The 16x16 (or 8x8) tiles are walked
+ * FIXED_BLOCK x FIXED_BLOCK at a time so the rotated writes of a block stay
+ * within a few pages of dest. (Forcing the tiles inline with flatten made
+ * the loops slower, so that's left to the compiler.)
+ */
+#define FIXED_BLOCK 64
+
+#define FIXED_COMPLEX_LOOP(N, T, tile_fn)                                                   \
+    int bi, bj, i, j;                                                                       \
+    for (bi = 0; bi < (N); bi += FIXED_BLOCK)                                               \
+        for (bj = 0; bj < (N); bj += FIXED_BLOCK)                                           \
+            for (i = bi; i < bi + FIXED_BLOCK; i += (T))                                    \
+                for (j = bj; j < bj + FIXED_BLOCK; j += (T))                                \
+                    tile_fn(src + RIDX(i, j, N), N, dst + RIDX((N) - j - (T), (N) - i - (T), N), N)
+
+static inline void complex_tile16_scalar(const pixel* s, int sstride, pixel* d, int dstride)
+{
+    complex_block(s, sstride, d, dstride, 16, 16);
+}
+
+/*
+ * motion_fixed_body - Rows 0..N-3 and columns 0..N-3 see the full 3x3
+ * window, so they're a plain column-sum-then-row-sum loop with the divide
+ * by 9 folded to a multiply; the two clipped rows and columns go to
+ * motion_region.
+ */
+static inline __attribute__((always_inline))
+void motion_fixed_body(int n, const pixel* src, pixel* dst, pixel_sum* cs)
+{
+    int i, j;
+
+    for (i = 0; i < n - 2; i++)
+    {
+        const pixel* p0 = src + RIDX(i, 0, n);
+        pixel* out = dst + RIDX(i, 0, n);
+
+        for (j = 0; j < n; j++)
+        {
+            cs[j].red = (unsigned int)p0[j].red + p0[j + n].red + p0[j + 2 * n].red;
+            cs[j].green = (unsigned int)p0[j].green + p0[j + n].green + p0[j + 2 * n].green;
+            cs[j].blue = (unsigned int)p0[j].blue + p0[j + n].blue + p0[j + 2 * n].blue;
+        }
+        for (j = 0; j < n - 2; j++)
+        {
+            out[j].red = (unsigned short)div_small(cs[j].red + cs[j + 1].red + cs[j + 2].red, 9);
+            out[j].green = (unsigned short)div_small(cs[j].green + cs[j + 1].green + cs[j + 2].green, 9);
+            out[j].blue = (unsigned short)div_small(cs[j].blue + cs[j + 1].blue + cs[j + 2].blue, 9);
+        }
+    }
+    motion_region(src + (n - 2), n, dst + (n - 2), n, 2, n - 2, 2, n);
+    motion_region(src + RIDX(n - 2, 0, n), n, dst + RIDX(n - 2, 0, n), n, n, 2, n, 2);
+}
+
+#ifdef HAVE_X86_SIMD
+#define FIXED_SIMD(N)                                                                       \
+TARGET_AVX2 static void complex_fixed##N##_avx2(const pixel* src, pixel* dst) \
+{ FIXED_COMPLEX_LOOP(N, 16, complex_tile16_avx2); }                                         \
+TARGET_SSE41 static void complex_fixed##N##_sse41(const pixel* src, pixel* dst) \
+{ FIXED_COMPLEX_LOOP(N, 8, complex_tile8_sse41); }
+#define FIXED_SIMD_PICK(N)                                                                  \
+    if (have_avx2) { complex_fixed##N##_avx2(src, dst); return; }                           \
+    if (have_sse41) { complex_fixed##N##_sse41(src, dst); return; }
+#else
+#define FIXED_SIMD(N)
+#define FIXED_SIMD_PICK(N)
+#endif
+
+/* complex_fixedN / motion_fixedN for one frame size N (a multiple of FIXED_BLOCK). */
+#define FIXED_SIZE(N)                                                                       \
+FIXED_SIMD(N)                                                                               \
+static void complex_fixed##N##_scalar(const pixel* src, pixel* dst) \
+{ FIXED_COMPLEX_LOOP(N, 16, complex_tile16_scalar); }                                       \
+static void complex_fixed##N(const pixel* src, pixel* dst)                                  \
+{                                                                                           \
+    FIXED_SIMD_PICK(N)                                                                      \
+    complex_fixed##N##_scalar(src, dst);                                                    \
+}                                                                                           \
+static void motion_fixed##N(const pixel* src, pixel* dst)                                   \
+{                                                                                           \
+    pixel_sum* cs = motion_scratch(N);                                                      \
+    if (cs)                                                                                 \
+        motion_fixed_body(N, src, dst, cs);                                                 \
+    else                                                                                    \
+        motion_region(src, N, dst, N, N, N, N, N);                                          \
+}
+
+FIXED_SIZE(256)
+FIXED_SIZE(512)
+FIXED_SIZE(1024)
+FIXED_SIZE(2048)
+FIXED_SIZE(4096)
+
+/*
+ * complex_fixed - The specialized copy for dim if there is one, else the
+ * dispatched region kernel.
+ */
+char complex_fixed_descr[] = "complex_fixed: Specialized for dim 256..4096, generic otherwise";
+void complex_fixed(int dim, pixel* src, pixel* dst)
+{
+    switch (dim)
+    {
+    case 256: complex_fixed256(src, dst); break;
+    case 512: complex_fixed512(src, dst); break;
+    case 1024: complex_fixed1024(src, dst); break;
+    case 2048: complex_fixed2048(src, dst); break;
+    case 4096: complex_fixed4096(src, dst); break;
+    default: complex_impl(src, dim, dst, dim, dim, dim);
+    }
+}
+
+/*
+ * motion_fixed - The specialized copy for dim if there is one, else the
+ * sliding-window kernel.
+ */
+char motion_fixed_descr[] = "motion_fixed: Specialized for dim 256..4096, generic otherwise";
+void motion_fixed(int dim, pixel* src, pixel* dst)
+{
+    switch (dim)
+    {
+    case 256: motion_fixed256(src, dst); break;
+    case 512: motion_fixed512(src, dst); break;
+    case 1024: motion_fixed1024(src, dst); break;
+    case 2048: motion_fixed2048(src, dst); break;
+    case 4096: motion_fixed4096(src, dst); break;
+    default: motion_region(src, dim, dst, dim, dim, dim, dim, dim);
+    }
+}
+
+
+/************************
+ * AUTOTUNED DISPATCH
+ ************************/
+
+/* Adapts a plain variant to the tuned_func signature; it has no knobs. */
+#define UNTUNED(f) \
+static void f##_tuned(int dim, pixel* src, pixel* dst, int threads, int block) { (void)threads; (void)block; f(dim, src, dst); }
+
+UNTUNED(complex_scalar)
+#ifdef HAVE_X86_SIMD
+UNTUNED(complex_sse41)
+UNTUNED(complex_avx2)
+#endif
+UNTUNED(complex_recursive)
+UNTUNED(complex_soa)
+UNTUNED(complex_fixed)
+UNTUNED(motion_unrolled)
+UNTUNED(motion_sliding)
+UNTUNED(motion_soa)
+UNTUNED(motion_fixed)
+
+static void complex_parallel_tuned(int dim, pixel* src, pixel* dst, int threads, int block)
+{
+    complex_parallel_n(threads, block, dim, src, dst);
+}
+
+static void motion_parallel_tuned(int dim, pixel* src, pixel* dst, int threads, int block)
+{
+    motion_parallel_n(threads, block, dim, src, dst);
+}
+
+enum { ISA_ANY, ISA_SSE41, ISA_AVX2 };
+
+/* Every variant complex/motion may dispatch to, tagged with what it needs. */
+static const struct {
+    kernel_variant v;
+    int isa;
+} variant_table[2][8] = {
+    {
+        { { "complex_scalar", complex_scalar_tuned, 0 }, ISA_ANY },
+#ifdef HAVE_X86_SIMD
+        { { "complex_sse41", complex_sse41_tuned, 0 }, ISA_SSE41 },
+        { { "complex_avx2", complex_avx2_tuned, 0 }, ISA_AVX2 },
+#endif
+        { { "complex_recursive", complex_recursive_tuned, 0 }, ISA_ANY },
+        { { "complex_parallel", complex_parallel_tuned, 1 }, ISA_ANY },
+        { { "complex_soa", complex_soa_tuned, 0 }, ISA_ANY },
+        { { "complex_fixed", complex_fixed_tuned, 0 }, ISA_ANY },
+    },
+    {
+        { { "motion_unrolled", motion_unrolled_tuned, 0 }, ISA_ANY },
+        { { "motion_sliding", motion_sliding_tuned, 0 }, ISA_ANY },
+        { { "motion_parallel", motion_parallel_tuned, 1 }, ISA_ANY },
+        { { "motion_soa", motion_soa_tuned, 0 }, ISA_ANY },
+        { { "motion_fixed", motion_fixed_tuned, 0 }, ISA_ANY },
+    },
+};
+
+/*
+ * kernel_variants - The dispatchable variants of a kernel this CPU can run.
+ * Sets *list and returns how many there are.
+ */
+int kernel_variants(int kernel, const kernel_variant** list)
+{
+    static kernel_variant usable[2][8];
+    static int count[2] = { -1, -1 };
+    int k;
+
+    if (count[kernel] < 0)
+    {
+        count[kernel] = 0;
+        for (k = 0; k < 8 && variant_table[kernel][k].v.name; k++)
+        {
+            int isa = variant_table[kernel][k].isa;
+            if ((isa == ISA_SSE41 && !have_sse41) || (isa == ISA_AVX2 && !have_avx2))
+                continue;
+            usable[kernel][count[kernel]++] = variant_table[kernel][k].v;
+        }
+    }
+    *list = usable[kernel];
+    return count[kernel];
+}
+
+/*
+ * load_kernel_profile - Reads an autotune profile, replacing any loaded one.
+ * Each line is "<complex|motion> <dim> <variant> <threads> <block>"; '#'
+ * starts a comment. Variants this build or CPU lacks are skipped.
+ * Returns the number of entries loaded, or -1 if the file can't be read.
+ */
+int load_kernel_profile(const char* path)
+{
+    char line[256], kname[32], vname[64];
+    int dim, threads, block, loaded = 0;
+    FILE* fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return -1;
+
+    profile_count[KERNEL_COMPLEX] = profile_count[KERNEL_MOTION] = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        const kernel_variant* list;
+        int kernel, n, k;
+
+        if (line[0] == '#' || sscanf(line, "%31s %d %63s %d %d", kname, &dim, vname, &threads, &block) != 5)
+            continue;
+        if (!strcmp(kname, "complex"))
+            kernel = KERNEL_COMPLEX;
+        else if (!strcmp(kname, "motion"))
+            kernel = KERNEL_MOTION;
+        else
+            continue;
+
+        n = kernel_variants(kernel, &list);
+        for (k = 0; k < n; k++)
+            if (!strcmp(list[k].name, vname))
+                break;
+        if (k == n || profile_count[kernel] == PROFILE_MAX)
+            continue;
+
+        profile[kernel][profile_count[kernel]].dim = dim;
+        profile[kernel][profile_count[kernel]].variant = &list[k];
+        profile[kernel][profile_count[kernel]].threads = threads;
+        profile[kernel][profile_count[kernel]].block = (block > 0) ? block : 32;
+        profile_count[kernel]++;
+        loaded++;
+    }
+
+    fclose(fp);
+    return loaded;
+}
+
+
+/************************
+ * CONVOLUTION ENGINE
+ ************************/
+
+#define MAX_WEIGHT 65535  // Keeps every weighted sum inside 64 bits.
+
+/* Per-channel weighted sum. */
+typedef struct {
+    unsigned long long red, green, blue;
+} conv_sum;
+
+/*
+ * Reciprocal divide for the clipped denominators, as in RECIPROCAL DIVISION
+ * above but with a wider shift: a window of weight d sums to s <= 65535 * d,
+ * and with M = ceil(2^47 / d) = (2^47 + e) / d, s * M / 2^47 overshoots s / d
+ * by s * e / (d * 2^47) < 1 / d whenever 65535 * d * d < 2^47, so the floor
+ * is exact for d <= CONV_RECIP_MAX_DEN and s * M stays below 2^63. Heavier
+ * kernels keep the 64-bit divide, flagged by a multiplier of 0.
+ */
+#define CONV_RECIP_SHIFT 47
+#define CONV_RECIP_MAX_DEN 46340
+
+static inline unsigned long long conv_recip(unsigned long long den)
+{
+    return (den <= CONV_RECIP_MAX_DEN) ? (((unsigned long long)1 << CONV_RECIP_SHIFT) + den - 1) / den : 0;
+}
+
+static inline unsigned short conv_div(unsigned long long s, unsigned long long den, unsigned long long m)
+{
+    return (unsigned short)(m ? (s * m) >> CONV_RECIP_SHIFT : s / den);
+}
+
+/*
+ * conv_make_separable - Kernel whose weights are row[a] * col[b].
+ * Returns -1 unless 1 <= n <= CONV_MAX, every factor and every product is
+ * in [0, MAX_WEIGHT] and row[0], col[0] > 0 (so a window clipped to its
+ * corner still has weight).
+ */
+int conv_make_separable(conv_kernel* k, int n, const int* row, const int* col)
+{
+    int a, b;
+
+    if (n < 1 || n > CONV_MAX || row[0] <= 0 || col[0] <= 0)
+        return -1;
+    for (a = 0; a < n; a++)
+        if (row[a] < 0 || row[a] > MAX_WEIGHT || col[a] < 0 || col[a] > MAX_WEIGHT)
+            return -1;
+    for (a = 0; a < n; a++)
+        for (b = 0; b < n; b++)
+            if ((long long)row[a] * col[b] > MAX_WEIGHT)
+                return -1;
+
+    k->n = n;
+    k->separable = 1;
+    for (a = 0; a < n; a++)
+    {
+        k->row[a] = row[a];
+        k->col[a] = col[a];
+        for (b = 0; b < n; b++)
+            k->weights[a * n + b] = row[a] * col[b];
+    }
+    return 0;
+}
+
+/*
+ * conv_box - n x n box blur; conv_box(k, 3) is motion.
+ */
+int conv_box(conv_kernel* k, int n)
+{
+    int ones[CONV_MAX], a;
+
+    for (a = 0; a < CONV_MAX; a++)
+        ones[a] = 1;
+    return conv_make_separable(k, n, ones, ones);
+}
+
+/*
+ * conv_make - Kernel from n*n row-major weights, same limits as above with
+ * weights[0] > 0. If the weights are rank 1 (w[a][b] * w[0][0] == w[a][0] *
+ * w[0][b]) the kernel is marked separable, with row = first column and col =
+ * first row. Those factors give w * w[0][0], and scaling numerator and
+ * denominator alike leaves every quotient exactly as it was.
+ */
+int conv_make(conv_kernel* k, int n, const int* weights)
+{
+    int a, b, separable = 1;
+
+    if (n < 1 || n > CONV_MAX || weights[0] <= 0)
+        return -1;
+    for (a = 0; a < n * n; a++)
+        if (weights[a] < 0 || weights[a] > MAX_WEIGHT)
+            return -1;
+
+    k->n = n;
+    for (a = 0; a < n; a++)
+    {
+        k->row[a] = weights[a * n];
+        k->col[a] = weights[a];
+        for (b = 0; b < n; b++)
+        {
+            k->weights[a * n + b] = weights[a * n + b];
+            if ((long long)weights[a * n + b] * weights[0] != (long long)weights[a * n] * weights[b])
+                separable = 0;
+        }
+    }
+    k->separable = separable;
+    return 0;
+}
+
+
+/*
+ * conv_hrow - Horizontal pass of one source row: out[j] = sum of col[b] *
+ * row[j+b] over the taps left of the right edge.
+ */
+static inline __attribute__((always_inline))
+void conv_hrow(int n, int dim, const pixel* row, const int* col, conv_sum* out)
+{
+    int j, b;
+
+    for (j = 0; j < dim; j++)
+    {
+        int cb = (dim - j < n) ? dim - j : n;
+        conv_sum s = { 0, 0, 0 };
+
+        for (b = 0; b < cb; b++)
+        {
+            s.red += (unsigned long long)col[b] * row[j + b].red;
+            s.green += (unsigned long long)col[b] * row[j + b].green;
+            s.blue += (unsigned long long)col[b] * row[j + b].blue;
+        }
+        out[j] = s;
+    }
+}
+
+/*
+ * conv_direct_impl - All n*n taps per pixel, for weights that don't factor,
+ * and for separable ones whose scratch can't be allocated: it needs none.
+ * den[ra][cb] is the weight of the window clipped to ra rows and cb columns.
+ */
+static inline __attribute__((always_inline))
+void conv_direct_impl(int n, int dim, const pixel* src, pixel* dst, const conv_kernel* k)
+{
+    unsigned long long den[CONV_MAX + 1][CONV_MAX + 1], recip[CONV_MAX + 1][CONV_MAX + 1];
+    int i, j, a, b;
+
+    for (a = 0; a <= n; a++)
+        for (b = 0; b <= n; b++)
+        {
+            den[a][b] = (a == 0 || b == 0) ? 0 :
+                den[a - 1][b] + den[a][b - 1] - den[a - 1][b - 1] + k->weights[(a - 1) * n + (b - 1)];
+            recip[a][b] = (a == 0 || b == 0) ? 0 : conv_recip(den[a][b]);
+        }
+
+    for (i = 0; i < dim; i++)
+    {
+        int ra = (dim - i < n) ? dim - i : n;
+        for (j = 0; j < dim; j++)
+        {
+            int cb = (dim - j < n) ? dim - j : n;
+            conv_sum s = { 0, 0, 0 };
+
+            for (a = 0; a < ra; a++)
+                for (b = 0; b < cb; b++)
+                {
+                    const pixel* p = &src[RIDX(i + a, j + b, dim)];
+                    unsigned long long w = (unsigned long long)k->weights[a * n + b];
+                    s.red += w * p->red;
+                    s.green += w * p->green;
+                    s.blue += w * p->blue;
+                }
+            dst[RIDX(i, j, dim)].red = conv_div(s.red, den[ra][cb], recip[ra][cb]);
+            dst[RIDX(i, j, dim)].green = conv_div(s.green, den[ra][cb], recip[ra][cb]);
+            dst[RIDX(i, j, dim)].blue = conv_div(s.blue, den[ra][cb], recip[ra][cb]);
+        }
+    }
+}
+
+/*
+ * conv_separable_impl - Horizontal pass into a ring of n rows, then the
+ * vertical pass down each column: 2n taps per pixel instead of n*n. The
+ * clipped denominator is the product of the row and column weights in range.
+ */
+static inline __attribute__((always_inline))
+void conv_separable_impl(int n, int dim, const pixel* src, pixel* dst, const conv_kernel* k)
+{
+    unsigned long long den[CONV_MAX + 1][CONV_MAX + 1], recip[CONV_MAX + 1][CONV_MAX + 1];
+    unsigned long long rsum[CONV_MAX + 1], csum[CONV_MAX + 1];
+    conv_sum* ring = malloc(sizeof(conv_sum) * n * dim);
+    int i, j, a, b;
+
+    if (!ring)
+    {
+        conv_direct_impl(n, dim, src, dst, k);
+        return;
+    }
+
+    rsum[0] = csum[0] = 0;
+    for (a = 1; a <= n; a++)
+    {
+        rsum[a] = rsum[a - 1] + k->row[a - 1];
+        csum[a] = csum[a - 1] + k->col[a - 1];
+    }
+    for (a = 1; a <= n; a++)
+        for (b = 1; b <= n; b++)
+        {
+            den[a][b] = rsum[a] * csum[b];
+            recip[a][b] = conv_recip(den[a][b]);
+        }
+
+    for (i = 0; i < n && i < dim; i++)
+        conv_hrow(n, dim, src + RIDX(i, 0, dim), k->col, ring + RIDX(i, 0, dim));
+
+    for (i = 0; i < dim; i++)
+    {
+        int ra = (dim - i < n) ? dim - i : n;
+        const conv_sum* rows[CONV_MAX];
+
+        if (i > 0 && i + n - 1 < dim)
+            conv_hrow(n, dim, src + RIDX(i + n - 1, 0, dim), k->col, ring + RIDX((i + n - 1) % n, 0, dim));
+        for (a = 0; a < ra; a++)
+            rows[a] = ring + RIDX((i + a) % n, 0, dim);
+
+        for (j = 0; j < dim; j++)
+        {
+            int cb = (dim - j < n) ? dim - j : n;
+            conv_sum s = { 0, 0, 0 };
+
+            for (a = 0; a < ra; a++)
+            {
+                const conv_sum* h = &rows[a][j];
+                s.red += (unsigned long long)k->row[a] * h->red;
+                s.green += (unsigned long long)k->row[a] * h->green;
+                s.blue += (unsigned long long)k->row[a] * h->blue;
+            }
+            dst[RIDX(i, j, dim)].red = conv_div(s.red, den[ra][cb], recip[ra][cb]);
+            dst[RIDX(i, j, dim)].green = conv_div(s.green, den[ra][cb], recip[ra][cb]);
+            dst[RIDX(i, j, dim)].blue = conv_div(s.blue, den[ra][cb], recip[ra][cb]);
+        }
+    }
+
+    free(ring);
+}
+
+/* Copies of both passes with n a compile-time constant, for the common sizes. */
+#define CONV_SIZED(N)                                                                                     \
+static void conv_separable_##N(int dim, const pixel* src, pixel* dst, const conv_kernel* k)              \
+{ conv_separable_impl(N, dim, src, dst, k); }                                                            \
+static void conv_direct_##N(int dim, const pixel* src, pixel* dst, const conv_kernel* k)                 \
+{ conv_direct_impl(N, dim, src, dst, k); }
+
+CONV_SIZED(3)
+CONV_SIZED(5)
+CONV_SIZED(7)
+
+/*
+ * convolve - Weighted n x n blur. dst(i, j) averages src over rows
+ * [i, i+n) and columns [j, j+n), the taps past the bottom/right edge left
+ * out of both the sum and the weight, exactly like weighted_combo.
+ */
+void convolve(int dim, pixel* src, pixel* dst, const conv_kernel* k)
+{
+    switch (k->n)
+    {
+    case 3:
+        (k->separable ? conv_separable_3 : conv_direct_3)(dim, src, dst, k);
+        break;
+    case 5:
+        (k->separable ? conv_separable_5 : conv_direct_5)(dim, src, dst, k);
+        break;
+    case 7:
+        (k->separable ? conv_separable_7 : conv_direct_7)(dim, src, dst, k);
+        break;
+    default:
+        if (k->separable)
+            conv_separable_impl(k->n, dim, src, dst, k);
+        else
+            conv_direct_impl(k->n, dim, src, dst, k);
+    }
+}
+
+
+/*
+ * motion_conv3 - The convolution engine's 3x3 box, checked by the driver
+ * against naive_motion.
+ */
+char motion_conv3_descr[] = "motion_conv3: Convolution engine, 3x3 box";
+void motion_conv3(int dim, pixel* src, pixel* dst)
+{
+    conv_kernel box;
+
+    conv_box(&box, 3);
+    convolve(dim, src, dst, &box);
+}
+
+
+/************************
+ * STREAMING (OUT-OF-CORE)
+ ************************/
+
+/*
+ * stream_io - pread/pwrite exactly len bytes at off, riding out short
+ * transfers and EINTR. A source that ends early fails with EIO.
+ */
+static int stream_io(int fd, void* buf, size_t len, off_t off, int writing)
+{
+    char* p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = writing ? pwrite(fd, p, len, off) : pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        p += n;
+        off += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Byte offset of pixel (i, j) in a dim x dim file image starting at base. */
+static off_t stream_offset(off_t base, int dim, int i, int j)
+{
+    return base + ((off_t)i * dim + j) * (off_t)sizeof(pixel);
+}
+
+/*
+ * complex_stream - External-memory rotate. The image is cut into T x T tiles,
+ * with T the largest edge whose source and rotated copies fit the budget.
+ * Each tile costs T strided reads of T pixels and T writes of T pixels into
+ * the mirrored destination tile; the rotate itself is the in-core region
+ * kernel. Returns 0, or -1 with errno set (EINVAL if budget is under 12
+ * bytes).
+ */
+int complex_stream(int dim, int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t budget)
+{
+    size_t edge = 1;
+    pixel *in, *out;
+    int tile, i, j, r;
+    int ret = 0;
+
+    while ((edge + 1) * (edge + 1) * 2 * sizeof(pixel) <= budget && edge < (size_t)dim)
+        edge++;
+    if (dim <= 0 || 2 * sizeof(pixel) > budget)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    tile = (int)edge;
+    if (tile >= 32 && tile < dim)
+        tile &= ~15;                // Keep the SIMD tiles whole
+
+    in = malloc(sizeof(pixel) * tile * tile);
+    out = malloc(sizeof(pixel) * tile * tile);
+    if (!in || !out)
+    {
+        free(in);
+        free(out);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < dim && ret == 0; i += tile)
+    {
+        int h = (dim - i < tile) ? dim - i : tile;
+        for (j = 0; j < dim && ret == 0; j += tile)
+        {
+            int w = (dim - j < tile) ? dim - j : tile;
+
+            for (r = 0; r < h && ret == 0; r++)
+                ret = stream_io(src_fd, in + RIDX(r, 0, w), sizeof(pixel) * w,
+                                stream_offset(src_off, dim, i + r, j), 0);
+            if (ret)
+                break;
+
+            // Source tile (i, j) lands w x h at row dim-j-w, column dim-i-h
+            complex_impl(in, w, out, h, h, w);
+            for (r = 0; r < w && ret == 0; r++)
+                ret = stream_io(dst_fd, out + RIDX(r, 0, h), sizeof(pixel) * h,
+                                stream_offset(dst_off, dim, dim - j - w + r, dim - i - h), 1);
+        }
+    }
+
+    free(in);
+    free(out);
+    return ret;
+}
+
+/*
+ * motion_stream - Motion blur in row strips. Output rows [r, r+R) need
+ * source rows [r, r+R+2), so each strip reads its rows plus a 2-row halo
+ * and writes R whole rows. R is the largest strip for which the input
+ * and output buffers fit the budget; fails with EINVAL if not even one
+ * row does (4 rows' worth of pixels).
+ */
+int motion_stream(int dim, int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t budget)
+{
+    size_t row_bytes = sizeof(pixel) * (size_t)dim;
+    size_t rows;
+    pixel *in, *out;
+    int strip, r;
+    int ret = 0;
+
+    if (dim <= 0 || budget / row_bytes < 4)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    rows = (budget / row_bytes - 2) / 2;
+    strip = (rows < (size_t)dim) ? (int)rows : dim;
+
+    in = malloc(row_bytes * (strip + 2));
+    out = malloc(row_bytes * strip);
+    if (!in || !out)
+    {
+        free(in);
+        free(out);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (r = 0; r < dim; r += strip)
+    {
+        int h = (dim - r < strip) ? dim - r : strip;
+        int need = (dim - r < h + 2) ? dim - r : h + 2;
+
+        if ((ret = stream_io(src_fd, in, row_bytes * need, stream_offset(src_off, dim, r, 0), 0)) != 0)
+            break;
+        motion_region(in, dim, out, dim, dim, h, dim, dim - r);
+        if ((ret = stream_io(dst_fd, out, row_bytes * h, stream_offset(dst_off, dim, r, 0), 1)) != 0)
+            break;
+    }
+
+    free(in);
+    free(out);
+    return ret;
+}
+
+
+/************************
+ * RECIPROCAL CHECK
+ ************************/
+
+#ifdef HAVE_X86_SIMD
+/* Mismatches of div_epu32_sse41 by d over all sums, four lanes at a time. */
+TARGET_SSE41 static long recip_check_sse41(unsigned int d)
+{
+    unsigned int n, k, out[4];
+    long bad = 0;
+
+    for (n = 0; n <= RECIP_MAX_SUM; n += 4)
+    {
+        __m128i x = _mm_add_epi32(_mm_set1_epi32((int)n), _mm_setr_epi32(0, 1, 2, 3));
+        _mm_storeu_si128((__m128i*)out, div_epu32_sse41(x, d));
+        for (k = 0; k < 4; k++)
+            bad += (out[k] != (n + k) / d);
+    }
+    return bad;
+}
+
+/* Mismatches of div_epu32_avx2 by d over all sums, eight lanes at a time. */
+TARGET_AVX2 static long recip_check_avx2(unsigned int d)
+{
+    unsigned int n, k, out[8];
+    long bad = 0;
+
+    for (n = 0; n <= RECIP_MAX_SUM; n += 8)
+    {
+        __m256i x = _mm256_add_epi32(_mm256_set1_epi32((int)n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        _mm256_storeu_si256((__m256i*)out, div_epu32_avx2(x, d));
+        for (k = 0; k < 8; k++)
+            bad += (out[k] != (n + k) / d);
+    }
+    return bad;
+}
+#endif
+
+/*
+ * recip_check - Compares the scalar reciprocal divide, and the SSE4.1 and
+ * AVX2 ones where the CPU has them (those take d >= 2), with real division
+ * for every divisor 1..RECIP_MAX_DIV and every sum 0..RECIP_MAX_SUM, plus
+ * the few lanes the vector loops run past it. Returns the number of
+ * mismatches (0 when the table is exact).
+ */
+long recip_check(void)
+{
+    long bad = 0;
+    unsigned int d, n;
+
+    for (d = 1; d <= RECIP_MAX_DIV; d++)
+    {
+        for (n = 0; n <= RECIP_MAX_SUM; n++)
+            bad += (div_small(n, d) != n / d);
+#ifdef HAVE_X86_SIMD
+        if (d >= 2 && have_sse41)
+            bad += recip_check_sse41(d);
+        if (d >= 2 && have_avx2)
+            bad += recip_check_avx2(d);
+#endif
+    }
+    return bad;
+}
+
+
+/************************
+ * BATCHED FRAMES
+ ************************/
+
+/* A size-sorted copy of the jobs, cut into one contiguous chunk per thread. */
+typedef struct {
+    kernel_job* jobs;
+    int* bound;                 // Chunk k runs jobs[bound[k] .. bound[k+1])
+    int motion;
+} batch_plan;
+
+static int batch_cmp(const void* a, const void* b)
+{
+    const kernel_job* x = a;
+    const kernel_job* y = b;
+
+    if (x->dim != y->dim)
+        return (x->dim < y->dim) ? -1 : 1;
+    return (x->src < y->src) ? -1 : (x->src > y->src);
+}
+
+/*
+ * batch_task - Runs one chunk straight through the region kernels; the
+ * per-frame profile lookup and dispatch of complex()/motion() is skipped.
+ */
+static void batch_task(void* arg, int item)
+{
+    const batch_plan* plan = arg;
+    int k;
+
+    for (k = plan->bound[item]; k < plan->bound[item + 1]; k++)
+    {
+        const kernel_job* job = &plan->jobs[k];
+
+        if (job->dim <= 0)
+            continue;
+        if (plan->motion)
+            motion_region(job->src, job->dim, job->dst, job->dim, job->dim, job->dim, job->dim, job->dim);
+        else
+            complex_impl(job->src, job->dim, job->dst, job->dim, job->dim, job->dim);
+    }
+}
+
+/*
+ * kernel_batch - Sorts the jobs by dim so each thread works through runs of
+ * same-sized frames, then cuts the sorted list into one chunk per thread
+ * with about the same number of pixels in each. If the plan can't be
+ * allocated, the jobs run one after another on this thread instead.
+ */
+static void kernel_batch(const kernel_job* jobs, int njobs, int motion)
+{
+    int nthreads = get_kernel_threads();
+    batch_plan plan;
+    double total = 0, done = 0;
+    int k, chunk, whole[2];
+
+    if (njobs <= 0)
+        return;
+    if (nthreads > njobs)
+        nthreads = njobs;
+
+    plan.jobs = malloc(sizeof(kernel_job) * njobs);
+    plan.bound = malloc(sizeof(int) * (nthreads + 1));
+    plan.motion = motion;
+    if (!plan.jobs || !plan.bound)
+    {
+        free(plan.jobs);
+        free(plan.bound);
+        whole[0] = 0;
+        whole[1] = njobs;
+        plan.jobs = (kernel_job*)jobs;
+        plan.bound = whole;
+        batch_task(&plan, 0);
+        return;
+    }
+    memcpy(plan.jobs, jobs, sizeof(kernel_job) * njobs);
+    qsort(plan.jobs, njobs, sizeof(kernel_job), batch_cmp);
+
+    for (k = 0; k < njobs; k++)
+        total += (double)plan.jobs[k].dim * plan.jobs[k].dim;
+
+    plan.bound[0] = 0;
+    for (k = 0, chunk = 1; chunk < nthreads; chunk++)
+    {
+        while (k < njobs && done < total * chunk / nthreads)
+        {
+            done += (double)plan.jobs[k].dim * plan.jobs[k].dim;
+            k++;
+        }
+        plan.bound[chunk] = k;
+    }
+    plan.bound[nthreads] = njobs;
+
+    pool_run(batch_task, &plan, nthreads, nthreads);
+
+    free(plan.jobs);
+    free(plan.bound);
+}
+
+/*
+ * complex_batch - complex() on every job, spread over the thread pool.
+ */
+void complex_batch(const kernel_job* jobs, int njobs)
+{
+    kernel_batch(jobs, njobs, 0);
+}
+
+/*
+ * motion_batch - motion() on every job, spread over the thread pool.
+ */
+void motion_batch(const kernel_job* jobs, int njobs)
+{
+    kernel_batch(jobs, njobs, 1);
+}
+
+
+/************************
+ * IN-PLACE COMPLEX
+ ************************/
+
+#define INPLACE_TILE 64     // Edge of the tiles swapped through the stack buffer
+
+/*
+ * complex_inplace - complex() with src and dest the same image. The
+ * anti-diagonal flip (i, j) -> (dim-1-j, dim-1-i) is its own inverse, so
+ * the image is cut into row bands [b(k), b(k+1)) and mirrored column bands
+ * [dim-b(l+1), dim-b(l)), b(k) = k * INPLACE_TILE; tile (k, l) lands on tile
+ * (l, k). Each pair is done by saving tile (k, l), converting (l, k) into
+ * its place and the saved copy into (l, k); tiles on the diagonal map to
+ * themselves and go through the buffer alone.
+ */
+void complex_inplace(int dim, pixel* img)
+{
+    pixel tmp[INPLACE_TILE * INPLACE_TILE];
+    int ntiles = (dim + INPLACE_TILE - 1) / INPLACE_TILE;
+    int k, l, r;
+
+    for (k = 0; k < ntiles; k++)
+    {
+        int bk = k * INPLACE_TILE;
+        int hk = (dim - bk < INPLACE_TILE) ? dim - bk : INPLACE_TILE;
+
+        for (l = k; l < ntiles; l++)
+        {
+            int bl = l * INPLACE_TILE;
+            int hl = (dim - bl < INPLACE_TILE) ? dim - bl : INPLACE_TILE;
+            pixel* a = img + RIDX(bk, dim - bl - hl, dim);      // Tile (k, l): hk x hl
+            pixel* b = img + RIDX(bl, dim - bk - hk, dim);      // Tile (l, k): hl x hk
+
+            for (r = 0; r < hk; r++)
+                memcpy(tmp + RIDX(r, 0, hl), a + RIDX(r, 0, dim), sizeof(pixel) * hl);
+            if (l != k)
+                complex_impl(b, dim, a, dim, hl, hk);
+            complex_impl(tmp, hl, b, dim, hk, hl);
+        }
+    }
+}
+
+/*
+ * complex_inplace_copy - The in-place kernel under the driver's interface:
+ * src is copied to dest, which is then converted in place.
+ */
+char complex_inplace_descr[] = "complex_inplace: Tile-pair swap in place (after copying src to dest)";
+void complex_inplace_copy(int dim, pixel* src, pixel* dest)
+{
+    memcpy(dest, src, sizeof(pixel) * dim * dim);
+    complex_inplace(dim, dest);
+}
+
+
+/************************
+ * IMAGE BUFFERS
+ ************************/
+
+#define HUGE_PAGE ((size_t)2 << 20)     // x86-64 large page; also the first-touch unit
+
+/* Mapping length of a dim x dim frame: whole huge pages. */
+static size_t image_bytes(int dim)
+{
+    size_t bytes = sizeof(pixel) * (size_t)dim * dim;
+    return (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+}
+
+/*
+ * touch_task - Faults in one huge page's worth of a new frame. Writing every
+ * 4 KB covers the case where the kernel backed it with small pages after all.
+ */
+static void touch_task(void* arg, int item)
+{
+    char* p = (char*)arg + (size_t)item * HUGE_PAGE;
+    size_t off;
+
+    for (off = 0; off < HUGE_PAGE; off += 4096)
+        p[off] = 0;
+}
+
+/*
+ * image_alloc - mmap a dim x dim frame on a huge-page boundary, over-mapping
+ * by one huge page and trimming the ends so THP can use 2 MB pages.
+ * IMAGE_HUGETLB asks for explicit huge pages first and falls back to an
+ * ordinary mapping when none are reserved. IMAGE_THP (and the fallback)
+ * advise transparent huge pages. IMAGE_FIRST_TOUCH faults the frame in from
+ * the pool with the same contiguous shares the parallel kernels use; the
+ * workers are pinned, and the caller is pinned to the first CPU while it
+ * touches share 0, so each page starts out on the NUMA node of a fixed CPU.
+ * Returns NULL if the mapping fails.
+ */
+pixel* image_alloc(int dim, int flags)
+{
+    size_t len = image_bytes(dim);
+    char* p = MAP_FAILED;
+
+    if (dim <= 0)
+        return NULL;
+#ifdef MAP_HUGETLB
+    if (flags & IMAGE_HUGETLB)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+    {
+        char* raw = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        size_t head;
+
+        if (raw == MAP_FAILED)
+            return NULL;
+        head = (HUGE_PAGE - ((size_t)raw & (HUGE_PAGE - 1))) & (HUGE_PAGE - 1);
+        if (head)
+            munmap(raw, head);
+        if (HUGE_PAGE - head)
+            munmap(raw + head + len, HUGE_PAGE - head);
+        p = raw + head;
+#ifdef MADV_HUGEPAGE
+        if (flags & (IMAGE_THP | IMAGE_HUGETLB))
+            madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (flags & IMAGE_FIRST_TOUCH)
+        pool_call(touch_task, p, (int)(len / HUGE_PAGE), kernel_threads, 1);
+    return (pixel*)p;
+}
+
+/*
+ * image_free - Unmaps a frame from image_alloc; dim must match.
+ */
+void image_free(pixel* img, int dim)
+{
+    if (img)
+        munmap(img, image_bytes(dim));
+}
+
+
+/************************
+ * INCREMENTAL MOTION
+ ************************/
+
+#define DIRTY_TILE 32   // Edge of the output tiles tracked for recomputation
+
+/* Output tiles to recompute, one byte each. */
+typedef struct {
+    int dim;
+    int ntiles;             // Per side
+    unsigned char* marks;
+} dirty_map;
+
+/*
+ * dirty_mark - Marks the output tiles a change to source rows [y, y+h) and
+ * columns [x, x+w) reaches. Output (i, j) reads source rows i..i+2 and
+ * columns j..j+2, so the affected outputs start 2 rows up and 2 columns
+ * left of the change.
+ */
+static void dirty_mark(dirty_map* map, int x, int y, int w, int h)
+{
+    int r0 = (y - 2 > 0) ? y - 2 : 0, c0 = (x - 2 > 0) ? x - 2 : 0;
+    int r1 = (y + h < map->dim) ? y + h : map->dim, c1 = (x + w < map->dim) ? x + w : map->dim;
+    int tr, tc;
+
+    if (r1 <= r0 || c1 <= c0)
+        return;
+    for (tr = r0 / DIRTY_TILE; tr <= (r1 - 1) / DIRTY_TILE; tr++)
+        for (tc = c0 / DIRTY_TILE; tc <= (c1 - 1) / DIRTY_TILE; tc++)
+            map->marks[tr * map->ntiles + tc] = 1;
+}
+
+/*
+ * dirty_flush - Recomputes the marked tiles, each horizontal run of them
+ * as one motion_region call. Returns the number of tiles redone.
+ */
+static int dirty_flush(const dirty_map* map, const pixel* src, pixel* dst)
+{
+    int dim = map->dim, n = map->ntiles;
+    int tr, tc, done = 0;
+
+    for (tr = 0; tr < n; tr++)
+    {
+        int i = tr * DIRTY_TILE;
+        int h = (dim - i < DIRTY_TILE) ? dim - i : DIRTY_TILE;
+
+        for (tc = 0; tc < n; )
+        {
+            int start = tc, j, w;
+
+            if (!map->marks[tr * n + tc])
+            {
+                tc++;
+                continue;
+            }
+            while (tc < n && map->marks[tr * n + tc])
+                tc++;
+            j = start * DIRTY_TILE;
+            w = ((tc * DIRTY_TILE < dim) ? tc * DIRTY_TILE : dim) - j;
+            motion_region(src + RIDX(i, j, dim), dim, dst + RIDX(i, j, dim), dim, w, h, dim - j, dim - i);
+            done += tc - start;
+        }
+    }
+    return done;
+}
+
+static int dirty_init(dirty_map* map, int dim)
+{
+    map->dim = dim;
+    map->ntiles = (dim + DIRTY_TILE - 1) / DIRTY_TILE;
+    map->marks = calloc((size_t)map->ntiles * map->ntiles, 1);
+    return map->marks ? 0 : -1;
+}
+
+/*
+ * motion_update - Brings dst, the motion blur of the previous frame, up to
+ * date for src, which differs from that frame only inside the dirty
+ * rectangles. Returns the number of DIRTY_TILE tiles recomputed, or -1
+ * if out of memory.
+ */
+int motion_update(int dim, pixel* src, pixel* dst, const image_rect* dirty, int ndirty)
+{
+    dirty_map map;
+    int k, done;
+
+    if (dirty_init(&map, dim))
+        return -1;
+    for (k = 0; k < ndirty; k++)
+        dirty_mark(&map, dirty[k].x, dirty[k].y, dirty[k].w, dirty[k].h);
+    done = dirty_flush(&map, src, dst);
+    free(map.marks);
+    return done;
+}
+
+/*
+ * motion_diff - motion_update without a dirty list: src is compared with
+ * the previous frame prev tile by tile, and every tile with any change
+ * counts as dirty.
+ */
+int motion_diff(int dim, const pixel* prev, pixel* src, pixel* dst)
+{
+    dirty_map map;
+    int tr, tc, r, done;
+
+    if (dirty_init(&map, dim))
+        return -1;
+    for (tr = 0; tr < map.ntiles; tr++)
+    {
+        int i = tr * DIRTY_TILE;
+        int h = (dim - i < DIRTY_TILE) ? dim - i : DIRTY_TILE;
+
+        for (tc = 0; tc < map.ntiles; tc++)
+        {
+            int j = tc * DIRTY_TILE;
+            int w = (dim - j < DIRTY_TILE) ? dim - j : DIRTY_TILE;
+
+            for (r = 0; r < h; r++)
+                if (memcmp(prev + RIDX(i + r, j, dim), src + RIDX(i + r, j, dim), sizeof(pixel) * w))
+                {
+                    dirty_mark(&map, j, i, w, h);
+                    break;
+                }
+        }
+    }
+    done = dirty_flush(&map, src, dst);
+    free(map.marks);
+    return done;
+}
+
+
+/************************
+ * GHOST-BORDER MOTION
+ ************************/
+
+#define GHOST_BAND 32   // Rows per strip when motion_ghosted builds the border itself
+
+/*
+ * Reciprocal maps for the ghost-border loop. With zeros past the edge every
+ * window sums 9 taps, and the divisor of output (i, j) is just the number
+ * of real rows times real columns, rdiv(i) * cdiv(j) with rdiv(i) =
+ * min(3, dim - i) and likewise cdiv. rmap[rd - 1][j] holds the reciprocal
+ * of rd * cdiv(j), so a row picks its map once and divides with a multiply.
+ */
+typedef struct {
+    unsigned long long* rmap[3];
+    pixel_sum* cs;          // dim + GHOST column sums
+} ghost_maps;
+
+static int ghost_maps_init(ghost_maps* g, int dim)
+{
+    int rd, j;
+
+    g->rmap[0] = malloc(sizeof(unsigned long long) * 3 * dim);
+    g->cs = malloc(sizeof(pixel_sum) * (dim + GHOST));
+    if (!g->rmap[0] || !g->cs)
+    {
+        free(g->rmap[0]);
+        free(g->cs);
+        return -1;
+    }
+    g->rmap[1] = g->rmap[0] + dim;
+    g->rmap[2] = g->rmap[1] + dim;
+    for (rd = 1; rd <= 3; rd++)
+        for (j = 0; j < dim; j++)
+            g->rmap[rd - 1][j] = recip_table[rd * ((dim - j < 3) ? dim - j : 3)];
+    return 0;
+}
+
+static void ghost_maps_free(ghost_maps* g)
+{
+    free(g->rmap[0]);
+    free(g->cs);
+}
+
+/*
+ * ghost_rows - Output rows [i0, i0+h) from a source whose row i0 is at p,
+ * with stride ps and at least GHOST zero columns and rows past the image.
+ * Every pixel runs the same two loops: a 3-row column sum, then a 3-column
+ * window divided through the row's reciprocal map.
+ */
+static void ghost_rows(const pixel* p, int ps, pixel* dst, int dim, int i0, int h, const ghost_maps* g)
+{
+    pixel_sum* cs = g->cs;
+    int r, j;
+
+    for (r = 0; r < h; r++)
+    {
+        const pixel* p0 = p + RIDX(r, 0, ps);
+        const pixel* p1 = p0 + ps;
+        const pixel* p2 = p1 + ps;
+        const unsigned long long* rm = g->rmap[((dim - i0 - r < 3) ? dim - i0 - r : 3) - 1];
+        pixel* out = dst + RIDX(i0 + r, 0, dim);
+
+        for (j = 0; j < dim + GHOST; j++)
+        {
+            cs[j].red = (unsigned int)p0[j].red + p1[j].red + p2[j].red;
+            cs[j].green = (unsigned int)p0[j].green + p1[j].green + p2[j].green;
+            cs[j].blue = (unsigned int)p0[j].blue + p1[j].blue + p2[j].blue;
+        }
+        for (j = 0; j < dim; j++)
+        {
+            out[j].red = (unsigned short)(((cs[j].red + cs[j + 1].red + cs[j + 2].red) * rm[j]) >> 32);
+            out[j].green = (unsigned short)(((cs[j].green + cs[j + 1].green + cs[j + 2].green) * rm[j]) >> 32);
+            out[j].blue = (unsigned short)(((cs[j].blue + cs[j + 1].blue + cs[j + 2].blue) * rm[j]) >> 32);
+        }
+    }
+}
+
+/*
+ * ghost_alloc - Zeroed dim x dim frame with GHOST spare columns on every row
+ * and GHOST spare rows below, so pixel (i, j) lives at RIDX(i, j, dim + GHOST).
+ * Leave the spares zero and pass the frame to motion_ghost.
+ */
+pixel* ghost_alloc(int dim)
+{
+    return calloc((size_t)(dim + GHOST) * (dim + GHOST), sizeof(pixel));
+}
+
+void ghost_free(pixel* padded)
+{
+    free(padded);
+}
+
+/*
+ * motion_ghost - motion() of a frame from ghost_alloc, with no edge cases.
+ * Returns 0, or -1 if out of memory.
+ */
+int motion_ghost(int dim, const pixel* padded, pixel* dst)
+{
+    ghost_maps g;
+
+    if (dim <= 0)
+        return 0;
+    if (ghost_maps_init(&g, dim))
+        return -1;
+    ghost_rows(padded, dim + GHOST, dst, dim, 0, dim, &g);
+    ghost_maps_free(&g);
+    return 0;
+}
+
+/*
+ * motion_ghosted - motion() on an ordinary frame: each GHOST_BAND-row strip,
+ * plus the 2 rows below it, is copied into a buffer with zeroed ghost
+ * columns, and zero rows stand in for those past the bottom edge. Runs
+ * plain motion() if the strip or maps can't be allocated.
+ */
+char motion_ghosted_descr[] = "motion_ghosted: Ghost border built per strip, divisor map";
+void motion_ghosted(int dim, pixel* src, pixel* dst)
+{
+    int ps = dim + GHOST;
+    pixel* strip = calloc((size_t)(GHOST_BAND + GHOST) * ps, sizeof(pixel));
+    ghost_maps g;
+    int i0, r;
+
+    if (!strip || ghost_maps_init(&g, dim))
+    {
+        free(strip);
+        motion(dim, src, dst);
+        return;
+    }
+    for (i0 = 0; i0 < dim; i0 += GHOST_BAND)
+    {
+        int h = (dim - i0 < GHOST_BAND) ? dim - i0 : GHOST_BAND;
+
+        for (r = 0; r < h + GHOST; r++)
+            if (i0 + r < dim)
+                memcpy(strip + RIDX(r, 0, ps), src + RIDX(i0 + r, 0, dim), sizeof(pixel) * dim);
+            else
+                memset(strip + RIDX(r, 0, ps), 0, sizeof(pixel) * dim);
+        ghost_rows(strip, ps, dst, dim, i0, h, &g);
+    }
+    ghost_maps_free(&g);
+    free(strip);
+}
+
+
+/************************
+ * STRIDED VIEWS
+ ************************/
 
- /*
-  * naive_motion - The naive baseline version of motion
-  */
-char naive_motion_descr[] = "naive_motion: Naive baseline implementation";
-void naive_motion(int dim, pixel* src, pixel* dst)
+/* A view is usable if it has pixels and each row fits in the stride. */
+static int view_ok(const image_view* v)
 {
-    int i, j;
+    return v && v->data && v->width > 0 && v->height > 0 && v->stride >= v->width;
+}
 
-    for (i = 0; i < dim; i++)
-        for (j = 0; j < dim; j++)
-            dst[RIDX(i, j, dim)] = weighted_combo(dim, i, j, src);
+/*
+ * complex_view - Grayscale + anti-diagonal flip of a width x height view
+ * into a height x width one: src (i, j) lands on dst (width-1-j, height-1-i).
+ * Runs the dispatched region kernel straight on the views' rows.
+ * Returns -1 if either view is malformed or dst has the wrong shape.
+ */
+int complex_view(const image_view* src, image_view* dst)
+{
+    if (!view_ok(src) || !view_ok(dst) || dst->width != src->height || dst->height != src->width)
+        return -1;
+    complex_impl(src->data, src->stride, dst->data, dst->stride, src->height, src->width);
+    return 0;
+}
+
+/*
+ * motion_view - motion() of a width x height view, with the window clipped
+ * at the view's own right and bottom edges. dst must be the same shape.
+ */
+int motion_view(const image_view* src, image_view* dst)
+{
+    if (!view_ok(src) || !view_ok(dst) || dst->width != src->width || dst->height != src->height)
+        return -1;
+    motion_region(src->data, src->stride, dst->data, dst->stride,
+                  src->width, src->height, src->width, src->height);
+    return 0;
 }
 
 
+/************************
+ * 8-BIT (RGBX32) PIPELINE
+ ************************/
+
+/* Multipliers for x / d as (x * M) >> 16, exact for the 8-bit sums (<= 9 * 255). */
+#define RECIP16(d) ((65536 + (d) - 1) / (d))
+
 /*
- * motion - Your current working version of motion.
- * IMPORTANT: This is the version you will be graded on
+ * pixel_to_pixel8 - Narrows to 8 bits per channel; anything above 255
+ * saturates. The pad byte is zeroed.
  */
-char motion_descr[] = "motion: Current working version";
-void motion(int dim, pixel* src, pixel* dst)
+void pixel_to_pixel8(int dim, const pixel* src, pixel8* dst)
 {
-    pixel work;
-    pixel* workPtr = &work;
+    size_t n = (size_t)dim * dim, k;
 
-    int i, j;
-    for (i = 0; i < dim - 2; i++) // Full 3x3 Pixels
+    for (k = 0; k < n; k++)
     {
-        for (j = 0; j < dim - 2; j++)
-        {
-            workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-                                               + (unsigned int)src[RIDX(i,   j+1, dim)].red
-                                               + (unsigned int)src[RIDX(i,   j+2, dim)].red
-                                               + (unsigned int)src[RIDX(i+1, j,   dim)].red
-                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].red
-                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].red
-                                               + (unsigned int)src[RIDX(i+2, j,   dim)].red
-                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].red
-                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].red) / 9);
+        dst[k].red = (unsigned char)(src[k].red > 255 ? 255 : src[k].red);
+        dst[k].green = (unsigned char)(src[k].green > 255 ? 255 : src[k].green);
+        dst[k].blue = (unsigned char)(src[k].blue > 255 ? 255 : src[k].blue);
+        dst[k].pad = 0;
+    }
+}
 
-            workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-                                               + (unsigned int)src[RIDX(i,   j+1, dim)].green
-                                               + (unsigned int)src[RIDX(i,   j+2, dim)].green
-                                               + (unsigned int)src[RIDX(i+1, j,   dim)].green
-                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].green
-                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].green
-                                               + (unsigned int)src[RIDX(i+2, j,   dim)].green
-                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].green
-                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].green) / 9);
+/*
+ * pixel8_to_pixel - Widens back to 16 bits per channel.
+ */
+void pixel8_to_pixel(int dim, const pixel8* src, pixel* dst)
+{
+    size_t n = (size_t)dim * dim, k;
 
-            workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-                                               + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-                                               + (unsigned int)src[RIDX(i,   j+2, dim)].blue
-                                               + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-                                               + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
-                                               + (unsigned int)src[RIDX(i+1, j+2, dim)].blue
-                                               + (unsigned int)src[RIDX(i+2, j,   dim)].blue
-                                               + (unsigned int)src[RIDX(i+2, j+1, dim)].blue
-                                               + (unsigned int)src[RIDX(i+2, j+2, dim)].blue) / 9);
+    for (k = 0; k < n; k++)
+    {
+        dst[k].red = src[k].red;
+        dst[k].green = src[k].green;
+        dst[k].blue = src[k].blue;
+    }
+}
 
-            dst[RIDX(i, j, dim)] = work;
+/*
+ * complex8_block - Scalar grayscale + rotate of an h x w block, laid out
+ * like complex_block.
+ */
+static void complex8_block(const pixel8* s, int sstride, pixel8* d, int dstride, int h, int w)
+{
+    int r, c;
+
+    for (r = 0; r < h; r++)
+        for (c = 0; c < w; c++)
+        {
+            const pixel8* p = &s[RIDX(r, c, sstride)];
+            unsigned char val = (unsigned char)div_small((unsigned int)p->red + p->green + p->blue, 3);
+            pixel8* out = &d[RIDX(w - 1 - c, h - 1 - r, dstride)];
+            out->red = out->green = out->blue = val;
+            out->pad = 0;
         }
-    }
+}
 
-    i = dim - 2;
-    for (j = 0; j < dim - 2; j++) // 2nd From Bottom Row
-    {
-        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
-                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
-                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
-                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].red) / 6);
+#ifdef HAVE_X86_SIMD
+/*
+ * gray8x8_avx2 - Gray RGBX pixels for 8 RGBX pixels. maddubs/madd sum the
+ * three channels of each 32-bit lane, and the gray byte is copied into the
+ * red, green and blue bytes.
+ */
+TARGET_AVX2 static inline __m256i gray8x8_avx2(__m256i p)
+{
+    __m256i sum = _mm256_madd_epi16(_mm256_maddubs_epi16(p, _mm256_set1_epi32(0x00010101)), _mm256_set1_epi16(1));
+    __m256i g = div_epu32_avx2(sum, 3);
 
-        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
-                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
-                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
-                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].green) / 6);
+    return _mm256_or_si256(_mm256_or_si256(g, _mm256_slli_epi32(g, 8)), _mm256_slli_epi32(g, 16));
+}
 
-        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
-                                           + (unsigned int)src[RIDX(i+1, j+2, dim)].blue) / 6);
-        dst[RIDX(i, j, dim)] = work;
-    }
+/*
+ * complex8_tile8_avx2 - 8x8 tile: one row of pixels per register, rows
+ * loaded bottom-up, an 8x8 transpose of 32-bit lanes, rows stored bottom-up.
+ */
+TARGET_AVX2 static void complex8_tile8_avx2(const pixel8* s, int sstride, pixel8* d, int dstride)
+{
+    __m256i r[8], t[8], u[8];
+    int k;
 
-    i = dim - 1;
-    for (j = 0; j < dim - 2; j++) // Bottom Row
+    for (k = 0; k < 8; k++)
+        r[7 - k] = gray8x8_avx2(_mm256_loadu_si256((const __m256i*)(s + RIDX(k, 0, sstride))));
+
+    for (k = 0; k < 8; k += 2)
     {
-        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
-                                           + (unsigned int)src[RIDX(i,   j+2, dim)].red) / 3);
+        t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+        t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+    }
+    for (k = 0; k < 8; k += 4)
+    {
+        u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+        u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+        u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+        u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+    }
+    for (k = 0; k < 4; k++)
+    {
+        r[k] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x20);
+        r[k + 4] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x31);
+    }
 
-        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
-                                           + (unsigned int)src[RIDX(i,   j+2, dim)].green) / 3);
+    for (k = 0; k < 8; k++)
+        _mm256_storeu_si256((__m256i*)(d + RIDX(7 - k, 0, dstride)), r[k]);
+}
 
-        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-                                           + (unsigned int)src[RIDX(i,   j+2, dim)].blue) / 3);
-        dst[RIDX(i, j, dim)] = work;
-    }
+/*
+ * motion8_vsum_avx2 - vs[4j..4j+3] = the nr-row channel sums of column j,
+ * widened to 16 bits, 8 columns at a time. Returns how many it did.
+ */
+TARGET_AVX2 static int motion8_vsum_avx2(const pixel8* p, int stride, int nr, int n, unsigned short* vs)
+{
+    int j, k;
 
-    j = dim - 2;
-    for (i = 0; i < dim - 2; i++) // 2nd From Right Column
+    for (j = 0; j + 8 <= n; j += 8)
     {
-        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].red
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
-                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].red
-                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red
-                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].red) / 6);
-
-        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].green
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
-                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].green
-                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green
-                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].green) / 6);
+        __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
 
-        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i+1, j+1, dim)].blue
-                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i+2, j+1, dim)].blue) / 6);
-        dst[RIDX(i, j, dim)] = work;
+        for (k = 0; k < nr; k++)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(p + RIDX(k, j, stride)));
+            lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)));
+            hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)));
+        }
+        _mm256_storeu_si256((__m256i*)(vs + 4 * j), lo);
+        _mm256_storeu_si256((__m256i*)(vs + 4 * j + 16), hi);
     }
+    return j;
+}
 
-    j = dim - 1;
-    for (i = 0; i < dim - 2; i++) // Right Column
-    {
-        workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].red
-                                           + (unsigned int)src[RIDX(i+2, j,   dim)].red) / 3);
+/*
+ * motion8_hsum_avx2 - out[j] = (vs[j] + vs[j+1] + vs[j+2]) / d for 8
+ * columns at a time, d >= 2, with the pad byte cleared. Returns how many
+ * columns it did.
+ */
+TARGET_AVX2 static int motion8_hsum_avx2(const unsigned short* vs, pixel8* out, int n, unsigned int d)
+{
+    const __m256i m = _mm256_set1_epi16((short)RECIP16(d));
+    const __m256i rgb = _mm256_set1_epi32(0x00FFFFFF);
+    int j;
 
-        workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].green
-                                           + (unsigned int)src[RIDX(i+2, j,   dim)].green) / 3);
+    for (j = 0; j + 8 <= n; j += 8)
+    {
+        const unsigned short* v = vs + 4 * j;
+        __m256i x0 = _mm256_add_epi16(_mm256_add_epi16(_mm256_loadu_si256((const __m256i*)v),
+                                                       _mm256_loadu_si256((const __m256i*)(v + 4))),
+                                      _mm256_loadu_si256((const __m256i*)(v + 8)));
+        __m256i x1 = _mm256_add_epi16(_mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(v + 16)),
+                                                       _mm256_loadu_si256((const __m256i*)(v + 20))),
+                                      _mm256_loadu_si256((const __m256i*)(v + 24)));
+        __m256i q = _mm256_packus_epi16(_mm256_mulhi_epu16(x0, m), _mm256_mulhi_epu16(x1, m));
 
-        workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-                                           + (unsigned int)src[RIDX(i+2, j,   dim)].blue) / 3);
-        dst[RIDX(i, j, dim)] = work;
+        // packus interleaves the 128-bit lanes; put the four quarters back in order
+        q = _mm256_permute4x64_epi64(q, 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + j), _mm256_and_si256(q, rgb));
     }
+    return j;
+}
+#endif
 
-    i = dim - 2;
-    j = dim - 2;  // One Up & Left of Bottom-Right Pixel
-    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].red
-                                       + (unsigned int)src[RIDX(i,   j+1, dim)].red
-                                       + (unsigned int)src[RIDX(i+1, j,   dim)].red
-                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].red) / 4);
-    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].green
-                                       + (unsigned int)src[RIDX(i,   j+1, dim)].green
-                                       + (unsigned int)src[RIDX(i+1, j,   dim)].green
-                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].green) / 4);
-    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j,   dim)].blue
-                                       + (unsigned int)src[RIDX(i,   j+1, dim)].blue
-                                       + (unsigned int)src[RIDX(i+1, j,   dim)].blue
-                                       + (unsigned int)src[RIDX(i+1, j+1, dim)].blue) / 4);
-    dst[RIDX(i, j, dim)] = work;
+/*
+ * complex8 - complex() for RGBX32 images: 8x8 AVX2 tiles where the CPU
+ * has AVX2, scalar for the fringe and everywhere else.
+ */
+void complex8(int dim, const pixel8* src, pixel8* dst)
+{
+    int full = 0, i, j;
 
-    i = dim - 2;
-    j = dim - 1;  // One Above Bottom-Right Pixel
-    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].red
-                                       + (unsigned int)src[RIDX(i+1, j, dim)].red) / 2);
-    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].green
-                                       + (unsigned int)src[RIDX(i+1, j, dim)].green) / 2);
-    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i,   j, dim)].blue
-                                       + (unsigned int)src[RIDX(i+1, j, dim)].blue) / 2);
-    dst[RIDX(i, j, dim)] = work;
+#ifdef HAVE_X86_SIMD
+    if (have_avx2)
+    {
+        full = dim & ~7;
+        for (i = 0; i < full; i += 8)
+            for (j = 0; j < full; j += 8)
+                complex8_tile8_avx2(src + RIDX(i, j, dim), dim, dst + RIDX(dim - j - 8, dim - i - 8, dim), dim);
+    }
+#endif
+    if (full < dim)
+    {
+        // Right strip over all rows, then the bottom strip left of it
+        complex8_block(src + full, dim, ROT_DEST(dst, dim, dim, dim, 0, full, dim, dim - full), dim,
+                       dim, dim - full);
+        complex8_block(src + RIDX(full, 0, dim), dim, ROT_DEST(dst, dim, dim, dim, full, 0, dim - full, full), dim,
+                       dim - full, full);
+    }
+}
 
-    i = dim - 1;
-    j = dim - 2;  // One Left of Bottom-Right Pixel
-    workPtr -> red   = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].red
-                                       + (unsigned int)src[RIDX(i, j+1, dim)].red) / 2);
-    workPtr -> green = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].green
-                                       + (unsigned int)src[RIDX(i, j+1, dim)].green) / 2);
-    workPtr -> blue  = (unsigned short)(((unsigned int)src[RIDX(i, j,   dim)].blue
-                                       + (unsigned int)src[RIDX(i, j+1, dim)].blue) / 2);
-    dst[RIDX(i, j, dim)] = work;
+/*
+ * motion8_direct - motion8 without the column-sum buffer, summing each
+ * clipped window in full. Only used if the buffer can't be allocated.
+ */
+static void motion8_direct(int dim, const pixel8* src, pixel8* dst)
+{
+    int i, j, a, b;
 
-    i = dim - 1;
-    j = dim - 1;  // Bottom-Right Pixel
-    dst[RIDX(i, j, dim)] = src[RIDX(i, j, dim)];
+    for (i = 0; i < dim; i++)
+    {
+        int nr = (dim - i < 3) ? dim - i : 3;
+        for (j = 0; j < dim; j++)
+        {
+            int nc = (dim - j < 3) ? dim - j : 3;
+            unsigned int sum[3] = { 0, 0, 0 };
+
+            for (a = 0; a < nr; a++)
+                for (b = 0; b < nc; b++)
+                {
+                    sum[0] += src[RIDX(i + a, j + b, dim)].red;
+                    sum[1] += src[RIDX(i + a, j + b, dim)].green;
+                    sum[2] += src[RIDX(i + a, j + b, dim)].blue;
+                }
+            dst[RIDX(i, j, dim)].red = (unsigned char)div_small(sum[0], nr * nc);
+            dst[RIDX(i, j, dim)].green = (unsigned char)div_small(sum[1], nr * nc);
+            dst[RIDX(i, j, dim)].blue = (unsigned char)div_small(sum[2], nr * nc);
+            dst[RIDX(i, j, dim)].pad = 0;
+        }
+    }
 }
 
-/*********************************************************************
- * register_motion_functions - Register all of your different versions
- *     of the motion kernel with the driver by calling the
- *     add_motion_function() for each test function.  When you run the
- *     driver program, it will test and report the performance of each
- *     registered test function.
- *********************************************************************/
+/*
+ * motion8 - motion() for RGBX32 images. Each output row takes the 16-bit
+ * sums of its nr (3, or fewer at the bottom) source rows per column, then
+ * divides 3-column sums by nr * 3 with a multiply-high, and by nr * 2 and
+ * nr for the last two columns. Every sum fits 16 bits (9 * 255).
+ */
+void motion8(int dim, const pixel8* src, pixel8* dst)
+{
+    unsigned short* vs = malloc(sizeof(unsigned short) * 4 * (size_t)dim);
+    int i, j, k;
 
-void register_motion_functions() {
-    add_motion_function(&motion, motion_descr);
-    add_motion_function(&naive_motion, naive_motion_descr);
-    //add_motion_function(&my_motion_v1, my_motion_v1_descr);
-    //add_motion_function(&my_motion_v2, my_motion_v2_descr);
+    if (!vs)
+    {
+        motion8_direct(dim, src, dst);
+        return;
+    }
+    for (i = 0; i < dim; i++)
+    {
+        const pixel8* p = src + RIDX(i, 0, dim);
+        pixel8* out = dst + RIDX(i, 0, dim);
+        int nr = (dim - i < 3) ? dim - i : 3;
+
+        j = 0;
+#ifdef HAVE_X86_SIMD
+        if (have_avx2)
+            j = motion8_vsum_avx2(p, dim, nr, dim, vs);
+#endif
+        for (; j < dim; j++)
+        {
+            // The pad lane is summed by motion8_hsum_avx2 too, then masked off
+            vs[4 * j] = vs[4 * j + 1] = vs[4 * j + 2] = vs[4 * j + 3] = 0;
+            for (k = 0; k < nr; k++)
+            {
+                vs[4 * j] += p[RIDX(k, j, dim)].red;
+                vs[4 * j + 1] += p[RIDX(k, j, dim)].green;
+                vs[4 * j + 2] += p[RIDX(k, j, dim)].blue;
+            }
+        }
+
+        j = 0;
+#ifdef HAVE_X86_SIMD
+        if (have_avx2 && dim > 2)
+            j = motion8_hsum_avx2(vs, out, dim - 2, nr * 3);
+#endif
+        for (; j < dim; j++)
+        {
+            int nc = (dim - j < 3) ? dim - j : 3;
+            unsigned int sum[3] = { 0, 0, 0 };
+
+            for (k = 0; k < nc; k++)
+            {
+                sum[0] += vs[4 * (j + k)];
+                sum[1] += vs[4 * (j + k) + 1];
+                sum[2] += vs[4 * (j + k) + 2];
+            }
+            out[j].red = (unsigned char)div_small(sum[0], nr * nc);
+            out[j].green = (unsigned char)div_small(sum[1], nr * nc);
+            out[j].blue = (unsigned char)div_small(sum[2], nr * nc);
+            out[j].pad = 0;
+        }
+    }
+    free(vs);
 }
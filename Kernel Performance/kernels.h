@@ -0,0 +1,222 @@
+/*
+ * kernels.h - Extensions to the Performance Lab kernels.
+ *
+ * defs.h is the lab's fixed interface, so everything kernels.c exports on
+ * top of it is declared here.
+ */
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include <sys/types.h>
+#include "defs.h"
+
+/*
+ * Parallel execution. The parallel variants run on a persistent pool of
+ * worker threads that is created on first use and reused for every call.
+ */
+void set_kernel_threads(int n);     /* Threads per parallel call (<= 0: one per online CPU) */
+int  get_kernel_threads(void);
+void set_complex_block(int size);   /* Edge length of a complex work block, in pixels */
+int  get_complex_block(void);
+void set_motion_band(int rows);     /* Rows per motion work band */
+int  get_motion_band(void);
+
+void complex_parallel(int dim, pixel* src, pixel* dest);
+void motion_parallel(int dim, pixel* src, pixel* dst);
+
+/*
+ * Frame buffers for big images. image_alloc maps a dim x dim frame that is
+ * 2 MB aligned and padded to whole 2 MB pages, so the kernels' strided
+ * column walks miss the TLB far less often. flags combine:
+ *   IMAGE_THP          transparent huge pages (madvise)
+ *   IMAGE_HUGETLB      explicit huge pages, falling back to THP if none are reserved
+ *   IMAGE_FIRST_TOUCH  fault the pages in from the thread pool, band by band
+ * Returns NULL on failure. Free with image_free and the same dim.
+ */
+enum {
+    IMAGE_THP = 1,
+    IMAGE_HUGETLB = 2,
+    IMAGE_FIRST_TOUCH = 4
+};
+
+pixel* image_alloc(int dim, int flags);
+void   image_free(pixel* img, int dim);
+
+/*
+ * Batches of independent frames, e.g. thousands of thumbnails. Jobs are
+ * grouped by dim and split over the thread pool by pixel count. Each frame
+ * goes straight to the region kernels, skipping per-call dispatch. Frames
+ * must not overlap one another.
+ */
+typedef struct {
+    int dim;
+    pixel* src;
+    pixel* dst;
+} kernel_job;
+
+void complex_batch(const kernel_job* jobs, int njobs);
+void motion_batch(const kernel_job* jobs, int njobs);
+
+/*
+ * complex() with no second buffer: img is replaced by its grayscale,
+ * anti-diagonally flipped image. Only a 64x64 tile of scratch is used.
+ */
+void complex_inplace(int dim, pixel* img);
+
+/*
+ * Ghost-border motion. A frame from ghost_alloc is zeroed and padded with
+ * GHOST extra columns per row and GHOST extra rows, so pixel (i, j) is at
+ * RIDX(i, j, dim + GHOST). motion_ghost then runs one uniform loop over
+ * every output, and a divisor map handles the clipped edges. It returns 0,
+ * or -1 if out of memory.
+ */
+#define GHOST 2
+
+pixel* ghost_alloc(int dim);
+void   ghost_free(pixel* padded);
+int    motion_ghost(int dim, const pixel* padded, pixel* dst);
+
+/*
+ * Incremental motion for video streams. dst holds motion() of the previous
+ * frame; only the outputs that can see a changed source pixel (the changed
+ * area plus 2 rows above and 2 columns to its left) are recomputed, in
+ * 32x32 tiles. motion_update takes the changed rectangles; motion_diff
+ * finds them by comparing src with the previous frame. Both return the
+ * number of tiles recomputed, or -1 if out of memory.
+ */
+typedef struct {
+    int x, y;               /* Left column, top row */
+    int w, h;
+} image_rect;
+
+int motion_update(int dim, pixel* src, pixel* dst, const image_rect* dirty, int ndirty);
+int motion_diff(int dim, const pixel* prev, pixel* src, pixel* dst);
+
+/*
+ * Views: a width x height window into a larger buffer, with rows stride
+ * pixels apart. Neither kernel copies. complex_view turns a W x H view into
+ * an H x W one; motion_view clips its window at the view's own edges.
+ * Both return 0, or -1 if a view is malformed or dst has the wrong shape.
+ * The views must not overlap.
+ */
+typedef struct {
+    int width;
+    int height;
+    int stride;             /* Pixels from one row to the next, >= width */
+    pixel* data;            /* Top-left pixel */
+} image_view;
+
+int complex_view(const image_view* src, image_view* dst);
+int motion_view(const image_view* src, image_view* dst);
+
+/*
+ * 8-bit pipeline. pixel8 is one RGBX32 word, two thirds of a pixel's bytes
+ * and one 32-bit SIMD lane. complex8/motion8 give exactly the 16-bit
+ * kernels' results whenever every channel is <= 255, so for 8-bit content
+ * the error is 0. pixel_to_pixel8 saturates larger channels to 255, and
+ * those results are then only as good as that clamp.
+ */
+typedef struct {
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+    unsigned char pad;      /* Always 0 in kernel output */
+} pixel8;
+
+void pixel_to_pixel8(int dim, const pixel* src, pixel8* dst);
+void pixel8_to_pixel(int dim, const pixel8* src, pixel* dst);
+void complex8(int dim, const pixel8* src, pixel8* dst);
+void motion8(int dim, const pixel8* src, pixel8* dst);
+
+/*
+ * Fused pipeline: same result as complex(dim, src, tmp) followed by
+ * motion(dim, tmp, dst), without the dim x dim intermediate image.
+ */
+void complex_motion(int dim, pixel* src, pixel* dst);
+
+/*
+ * Planar (SoA) image: one 64-byte aligned dim x dim plane per channel.
+ * The planar kernels take and produce planar_image, so frames kept planar
+ * never pay for deinterleaving. dst must be allocated for src's dim.
+ */
+typedef struct {
+    int dim;
+    unsigned short* red;
+    unsigned short* green;
+    unsigned short* blue;
+} planar_image;
+
+int  planar_alloc(planar_image* img, int dim);   /* 0 on success, -1 if out of memory */
+void planar_free(planar_image* img);
+void pixel_to_planar(int dim, const pixel* src, planar_image* dst);
+void planar_to_pixel(const planar_image* src, pixel* dst);
+
+void complex_planar(const planar_image* src, planar_image* dst);
+void motion_planar(const planar_image* src, planar_image* dst);
+
+/*
+ * Convolution engine: n x n weighted blur anchored at the top-left like
+ * motion, with taps past the bottom/right edge dropped from both the sum
+ * and the weight. conv_box(k, 3) reproduces motion exactly. Separable
+ * kernels run as a horizontal and a vertical pass; n = 3, 5 and 7 get
+ * copies specialized at compile time. Constructors return 0, or -1 for
+ * n outside [1, CONV_MAX], negative weights, weights over 65535, or a
+ * zero top-left weight.
+ */
+#define CONV_MAX 15
+
+typedef struct {
+    int n;
+    int separable;                  /* weights[a*n+b] is proportional to row[a] * col[b] */
+    int row[CONV_MAX];
+    int col[CONV_MAX];
+    int weights[CONV_MAX * CONV_MAX];
+} conv_kernel;
+
+int  conv_box(conv_kernel* k, int n);
+int  conv_make(conv_kernel* k, int n, const int* weights);     /* Detects separable weights */
+int  conv_make_separable(conv_kernel* k, int n, const int* row, const int* col);
+void convolve(int dim, pixel* src, pixel* dst, const conv_kernel* k);
+
+/*
+ * Out-of-core kernels for images too big to hold in memory. src_fd and
+ * dst_fd hold dim x dim row-major pixels starting at the given byte offsets
+ * and are accessed with pread/pwrite (dst_fd must be a different file).
+ * Working buffers stay within budget bytes. Both return 0, or -1 with errno
+ * set.
+ */
+int complex_stream(int dim, int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t budget);
+int motion_stream(int dim, int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t budget);
+
+/*
+ * Division by the small averaging divisors goes through a table of
+ * multiply-and-shift reciprocals. They are exact for sums up to 9 * 65535.
+ * recip_check() exhaustively compares them with real division and returns
+ * the number of mismatches.
+ */
+#define RECIP_MAX_DIV 9
+#define RECIP_MAX_SUM (9u * 65535u)
+
+long recip_check(void);
+
+/*
+ * Autotuning. Each variant complex() and motion() may dispatch to sits
+ * behind one signature; threads and block (complex block edge, motion band
+ * height) mean nothing to variants without those knobs. autotune.c times
+ * them on the host and writes a profile that kernels.c loads at startup
+ * from $KERNELS_PROFILE, or ./kernels.profile.
+ */
+enum { KERNEL_COMPLEX, KERNEL_MOTION };
+
+typedef void (*tuned_func)(int dim, pixel* src, pixel* dst, int threads, int block);
+
+typedef struct {
+    const char* name;   /* Variant name, as in its descr */
+    tuned_func fn;
+    int tunable;        /* Uses threads and block */
+} kernel_variant;
+
+int kernel_variants(int kernel, const kernel_variant** list);   /* Returns the count */
+int load_kernel_profile(const char* path);                      /* Entries loaded, -1 if unreadable */
+
+#endif /* _KERNELS_H_ */
@@ -0,0 +1,103 @@
+/*
+ * perfctr.c - Thin wrapper over Linux perf_event_open. Each event gets its
+ * own counter, so a CPU or VM that lacks one event still counts the rest.
+ * Only user-space events of the calling process (and its threads created
+ * afterwards) are counted, which works at perf_event_paranoid <= 2.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+/* Config of a PERF_TYPE_HW_CACHE event: which cache, which access, which outcome. */
+#define HW_CACHE(cache, op, result) \
+    ((cache) | ((unsigned long long)(op) << 8) | ((unsigned long long)(result) << 16))
+
+static const struct {
+    const char* name;
+    unsigned int type;
+    unsigned long long config;
+} events[PERF_NUM_EVENTS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "l1d_load_misses", PERF_TYPE_HW_CACHE,
+      HW_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "dtlb_load_misses", PERF_TYPE_HW_CACHE,
+      HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "dtlb_store_misses", PERF_TYPE_HW_CACHE,
+      HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_WRITE, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+};
+
+void perf_open(perf_counters* pc)
+{
+    struct perf_event_attr attr;
+    int e;
+
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.disabled = 1;
+        attr.inherit = 1;           // Count the thread pool's workers too
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        pc->fd[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+void perf_close(perf_counters* pc)
+{
+    int e;
+
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+        if (pc->fd[e] >= 0)
+        {
+            close(pc->fd[e]);
+            pc->fd[e] = -1;
+        }
+}
+
+int perf_available(const perf_counters* pc, int event)
+{
+    return pc->fd[event] >= 0;
+}
+
+const char* perf_event_name(int event)
+{
+    return events[event].name;
+}
+
+void perf_start(perf_counters* pc)
+{
+    int e;
+
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+        if (pc->fd[e] >= 0)
+        {
+            ioctl(pc->fd[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+void perf_stop(perf_counters* pc, long long* values)
+{
+    int e;
+
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+    {
+        values[e] = -1;
+        if (pc->fd[e] >= 0)
+        {
+            ioctl(pc->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(pc->fd[e], &values[e], sizeof(values[e])) != sizeof(values[e]))
+                values[e] = -1;
+        }
+    }
+}
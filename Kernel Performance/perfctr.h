@@ -0,0 +1,31 @@
+/*
+ * perfctr.h - Thin wrapper over Linux perf_event_open for counting
+ * hardware events around a kernel call in this process.
+ */
+#ifndef _PERFCTR_H_
+#define _PERFCTR_H_
+
+/* Events a counter set can hold. */
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,      /* Last-level cache misses */
+    PERF_L1D_MISSES,        /* L1 data cache load misses */
+    PERF_DTLB_LOAD_MISSES,
+    PERF_DTLB_STORE_MISSES,
+    PERF_NUM_EVENTS
+};
+
+typedef struct {
+    int fd[PERF_NUM_EVENTS];    /* -1 where the event isn't available */
+} perf_counters;
+
+void perf_open(perf_counters* pc);      /* Opens every event the kernel/CPU allows */
+void perf_close(perf_counters* pc);
+int  perf_available(const perf_counters* pc, int event);
+const char* perf_event_name(int event);
+
+void perf_start(perf_counters* pc);     /* Resets and enables all counters */
+void perf_stop(perf_counters* pc, long long* values);  /* values[event], -1 if unavailable */
+
+#endif /* _PERFCTR_H_ */